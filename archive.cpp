@@ -0,0 +1,686 @@
+#include "archive.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include "log.h"
+#include "sparse.h"
+
+namespace {
+
+constexpr uint32_t kSkippableMagic = 0x184D2A50;
+constexpr uint32_t kSeekTableMagic = 0x184D2A5E;  // Skippable frame 14
+constexpr uint32_t kSeekableMagic = 0x8F92EAB1;
+constexpr char kIndexMagic[8] = {'T', 'S', 'A', 'R', 'I', 'D', 'X', '1'};
+// Number of frames, descriptor, magic
+constexpr size_t kSeekFooterSize = 9;
+
+// Frames compressed but not yet written, per compression thread
+constexpr size_t kFramesPerThread = 4;
+
+// Archive structures are little endian, as zstd's are
+void Put32(std::string& out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+void Put64(std::string& out, uint64_t value) {
+  for (int i = 0; i < 8; ++i) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+bool Get32(const char*& data, const char* end, uint32_t& value) {
+  if (end - data < 4) {
+    return false;
+  }
+  value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i]))
+             << (8 * i);
+  }
+  data += 4;
+  return true;
+}
+
+bool Get64(const char*& data, const char* end, uint64_t& value) {
+  uint32_t low;
+  uint32_t high;
+  if (not Get32(data, end, low) or not Get32(data, end, high)) {
+    return false;
+  }
+  value = static_cast<uint64_t>(high) << 32 | low;
+  return true;
+}
+
+bool GetString(const char*& data, const char* end, std::string& value) {
+  uint32_t length;
+  if (not Get32(data, end, length) or
+      static_cast<size_t>(end - data) < length) {
+    return false;
+  }
+  value.assign(data, length);
+  data += length;
+  return true;
+}
+
+void PutString(std::string& out, const std::string& value) {
+  Put32(out, value.size());
+  out.append(value);
+}
+
+int WriteAll(int fd, const char* data, size_t size, uint64_t offset) {
+  for (size_t done = 0; done < size;) {
+    const ssize_t n = ::pwrite(fd, data + done, size - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+int ReadAll(int fd, char* data, size_t size, uint64_t offset) {
+  for (size_t done = 0; done < size;) {
+    const ssize_t n = ::pread(fd, data + done, size - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      return -EIO;  // Truncated archive
+    }
+    done += n;
+  }
+  return 0;
+}
+
+}  // namespace
+
+ArchiveWriter::ArchiveWriter(std::shared_ptr<ceph_mount_info> mount,
+                             const ArchiveOptions& options)
+    : mount_(mount),
+      options_(options),
+      pool_(std::max<size_t>(1, options.threads)),
+      small_files_(mount, options.small_files,
+                   [this](FileBatch& batch) { return AddBatch(batch); }) {}
+
+ArchiveWriter::~ArchiveWriter() {
+  small_files_.Finish();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return written_ == submitted_; });
+
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+int ArchiveWriter::Open(const std::string& path) {
+  fd_ = ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd_ < 0) {
+    const int result = -errno;
+    LOG(kError) << "Failed to create archive " << path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+  return 0;
+}
+
+int ArchiveWriter::Add(const std::string& path, const struct ceph_statx& sb,
+                       std::shared_ptr<Inode> inode) {
+  Record record;
+  record.path = path;
+  record.mode = sb.stx_mode;
+  record.mtime = sb.stx_mtime.tv_sec;
+
+  if (S_ISREG(sb.stx_mode)) {
+    record.size = sb.stx_size;
+    if (sb.stx_size <= options_.small_files.max_file_size) {
+      return small_files_.Add(path, sb, inode);
+    }
+    int result = AddLargeFile(record, inode.get());
+    if (result) {
+      return result;
+    }
+  } else if (S_ISLNK(sb.stx_mode)) {
+    record.link.resize(sb.stx_size ? sb.stx_size : PATH_MAX);
+
+    int result = ceph_ll_readlink(mount_.get(), inode.get(),
+                                  record.link.data(), record.link.size(),
+                                  ceph_mount_perms(mount_.get()));
+    if (result < 0) {
+      LOG(kError) << "Failed to read link " << path << ": error " << -result
+                  << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+    record.link.resize(result);
+  }
+
+  return AddRecord(std::move(record));
+}
+
+int ArchiveWriter::AddBatch(FileBatch& batch) {
+  uint64_t stream = 0;
+
+  if (not batch.data.empty()) {
+    int result = Submit(std::string(batch.data.begin(), batch.data.end()),
+                        stream);
+    if (result) {
+      return result;
+    }
+  }
+
+  for (auto& file : batch.files) {
+    if (file.result) {
+      return file.result;  // Already logged by the reader
+    }
+
+    Record record;
+    record.path = std::move(file.path);
+    record.mode = file.sb.stx_mode;
+    record.size = file.sb.stx_size;
+    record.mtime = file.sb.stx_mtime.tv_sec;
+    if (file.size) {
+      record.extents.push_back({0, file.size, stream + file.offset});
+    }
+
+    int result = AddRecord(std::move(record));
+    if (result) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+int ArchiveWriter::AddLargeFile(Record& record, Inode* inode) {
+  Fh* fh = nullptr;
+  int result = ceph_ll_open(mount_.get(), inode, O_RDONLY, &fh,
+                            ceph_mount_perms(mount_.get()));
+  if (result < 0) {
+    LOG(kError) << "Failed to open " << record.path << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<Fh> scoped_fh(
+      fh, [this](Fh* fh) { ceph_ll_close(mount_.get(), fh); });
+
+  // Runs gathered into `frame`, with their position in it as `stream`
+  std::string frame;
+  std::vector<Extent> pending;
+
+  auto submit = [&]() {
+    uint64_t stream;
+    int result = Submit(std::move(frame), stream);
+    if (result) {
+      return result;
+    }
+    for (auto& extent : pending) {
+      extent.stream += stream;
+      record.extents.push_back(extent);
+    }
+    frame.clear();
+    pending.clear();
+    return 0;
+  };
+
+  result = ReadSparse(
+      mount_, fh, record.size,
+      [&](uint64_t offset, const char* data, size_t size) {
+        while (size) {
+          const size_t take =
+              std::min(size, options_.frame_size - frame.size());
+
+          if (not pending.empty() and
+              pending.back().offset + pending.back().length == offset) {
+            pending.back().length += take;
+          } else {
+            pending.push_back({offset, take, frame.size()});
+          }
+          frame.append(data, take);
+
+          if (frame.size() == options_.frame_size) {
+            int result = submit();
+            if (result) {
+              return result;
+            }
+          }
+          offset += take;
+          data += take;
+          size -= take;
+        }
+        return 0;
+      });
+  if (result) {
+    return result;
+  }
+
+  return frame.empty() ? 0 : submit();
+}
+
+int ArchiveWriter::AddRecord(Record record) {
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  index_.push_back(std::move(record));
+  return 0;
+}
+
+int ArchiveWriter::Submit(std::string data, uint64_t& stream) {
+  const size_t limit = pool_.size() * kFramesPerThread;
+
+  // Waiting for the compressors below releases `mutex_`; holding this
+  // keeps other callers from taking sequence numbers in between, so the
+  // frames of one call are consecutive and start at `stream`
+  std::lock_guard<std::mutex> submit_lock(submit_mutex_);
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  stream = stream_;
+  stream_ += data.size();
+
+  for (size_t offset = 0; offset < data.size();) {
+    cv_.wait(lock,
+             [this, limit] { return error_ or submitted_ - written_ < limit; });
+    if (error_) {
+      return error_;
+    }
+
+    const size_t size = std::min(options_.frame_size, data.size() - offset);
+    std::string frame =
+        offset == 0 and size == data.size() ? std::move(data)
+                                            : data.substr(offset, size);
+    const uint64_t sequence = submitted_++;
+
+    pool_.Post([this, sequence, frame = std::move(frame)]() mutable {
+      Compress(sequence, std::move(frame));
+    });
+    offset += size;
+  }
+  return 0;
+}
+
+void ArchiveWriter::Compress(uint64_t sequence, std::string data) {
+  thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(
+      ZSTD_createCCtx(), ZSTD_freeCCtx);
+
+  std::string compressed(ZSTD_compressBound(data.size()), '\0');
+  const size_t size =
+      ZSTD_compressCCtx(context.get(), compressed.data(), compressed.size(),
+                        data.data(), data.size(), options_.level);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ZSTD_isError(size)) {
+      LOG(kError) << "Failed to compress frame " << sequence << ": "
+                  << ZSTD_getErrorName(size);
+      if (not error_) {
+        error_ = -EIO;
+      }
+      compressed.clear();
+    } else {
+      compressed.resize(size);
+    }
+    // Keep the decompressed size alongside for the seek table
+    Put32(compressed, data.size());
+    compressed_.emplace(sequence, std::move(compressed));
+  }
+
+  WriteFrames();
+}
+
+void ArchiveWriter::WriteFrames() {
+  std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+  while (true) {
+    std::string frame;
+    bool skip;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto next = compressed_.find(written_);
+      if (next == compressed_.end()) {
+        return;
+      }
+      frame = std::move(next->second);
+      compressed_.erase(next);
+      skip = error_ != 0;
+    }
+
+    const char* tail = frame.data() + frame.size() - 4;
+    uint32_t size;
+    Get32(tail, frame.data() + frame.size(), size);
+    frame.resize(frame.size() - 4);
+
+    int result = skip ? 0 : WriteAll(fd_, frame.data(), frame.size(),
+                                      file_bytes_);
+    if (result) {
+      LOG(kError) << "Failed to write archive: error " << -result << " ("
+                  << ::strerror(-result) << ")";
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (result and not error_) {
+        error_ = result;
+      }
+      if (not skip and not result) {
+        frames_.emplace_back(frame.size(), size);
+        file_bytes_ += frame.size();
+      }
+      ++written_;
+    }
+    cv_.notify_all();
+  }
+}
+
+int ArchiveWriter::Finish(ArchiveStats* stats) {
+  int result = small_files_.Finish();
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return written_ == submitted_; });
+    if (not result) {
+      result = error_;
+    }
+  }
+
+  if (result == 0) {
+    result = WriteTrailer();
+  }
+
+  if (result == 0 and ::fsync(fd_)) {
+    result = -errno;
+    LOG(kError) << "Failed to sync archive: error " << -result << " ("
+                << ::strerror(-result) << ")";
+  }
+
+  if (stats) {
+    stats->files = index_.size();
+    stats->frames = frames_.size();
+    stats->data_bytes = stream_;
+    stats->compressed_bytes = file_bytes_;
+  }
+  return result;
+}
+
+int ArchiveWriter::WriteTrailer() {
+  std::string index(kIndexMagic, sizeof(kIndexMagic));
+  Put64(index, index_.size());
+  for (const auto& record : index_) {
+    PutString(index, record.path);
+    Put32(index, record.mode);
+    Put64(index, record.size);
+    Put64(index, record.mtime);
+    PutString(index, record.link);
+    Put32(index, record.extents.size());
+    for (const auto& extent : record.extents) {
+      Put64(index, extent.offset);
+      Put64(index, extent.length);
+      Put64(index, extent.stream);
+    }
+  }
+
+  if (index.size() > UINT32_MAX) {
+    LOG(kError) << "Archive index of " << index.size() << " bytes is too big";
+    return -EFBIG;
+  }
+
+  std::string trailer;
+  Put32(trailer, kSkippableMagic);
+  Put32(trailer, index.size());
+  trailer.append(index);
+
+  Put32(trailer, kSeekTableMagic);
+  Put32(trailer, frames_.size() * 8 + kSeekFooterSize);
+  for (const auto& frame : frames_) {
+    Put32(trailer, frame.first);
+    Put32(trailer, frame.second);
+  }
+  Put32(trailer, frames_.size());
+  trailer.push_back(0);  // No checksums
+  Put32(trailer, kSeekableMagic);
+
+  int result = WriteAll(fd_, trailer.data(), trailer.size(), file_bytes_);
+  if (result) {
+    LOG(kError) << "Failed to write archive index: error " << -result << " ("
+                << ::strerror(-result) << ")";
+    return result;
+  }
+
+  file_bytes_ += trailer.size();
+  return 0;
+}
+
+int ExtractFile(const std::string& archive, const std::string& path,
+                const std::string& destination) {
+  const int fd = ::open(archive.c_str(), O_RDONLY);
+  if (fd < 0) {
+    const int result = -errno;
+    LOG(kError) << "Failed to open archive " << archive << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<void> scoped_fd(nullptr, [fd](void*) { ::close(fd); });
+
+  struct stat st;
+  if (::fstat(fd, &st)) {
+    return -errno;
+  }
+
+  // Seek table: frame sizes, from which the frame offsets follow
+  std::string footer(kSeekFooterSize, '\0');
+  if (static_cast<uint64_t>(st.st_size) < kSeekFooterSize or
+      ReadAll(fd, footer.data(), footer.size(),
+              st.st_size - kSeekFooterSize)) {
+    LOG(kError) << archive << " is not a snapshot archive";
+    return -EINVAL;
+  }
+
+  const char* p = footer.data();
+  const char* end = p + footer.size();
+  uint32_t frame_count = 0;
+  uint32_t magic = 0;
+  Get32(p, end, frame_count);
+  ++p;  // Descriptor
+  Get32(p, end, magic);
+
+  const uint64_t table_size = 8 + frame_count * 8ull + kSeekFooterSize;
+  if (magic != kSeekableMagic or
+      static_cast<uint64_t>(st.st_size) < table_size) {
+    LOG(kError) << archive << " is not a snapshot archive";
+    return -EINVAL;
+  }
+
+  std::string table(table_size, '\0');
+  int result =
+      ReadAll(fd, table.data(), table.size(), st.st_size - table_size);
+  if (result) {
+    return result;
+  }
+
+  // {file offset, stream offset, compressed size, decompressed size}
+  struct Frame {
+    uint64_t file;
+    uint64_t stream;
+    uint32_t compressed;
+    uint32_t size;
+  };
+  std::vector<Frame> frames;
+  uint64_t file_offset = 0;
+  uint64_t stream_offset = 0;
+
+  p = table.data() + 8;
+  end = table.data() + table.size();
+  for (uint32_t i = 0; i < frame_count; ++i) {
+    Frame frame = {file_offset, stream_offset, 0, 0};
+    Get32(p, end, frame.compressed);
+    Get32(p, end, frame.size);
+    file_offset += frame.compressed;
+    stream_offset += frame.size;
+    frames.push_back(frame);
+  }
+
+  // The index frame follows the data frames
+  std::string header(8, '\0');
+  result = ReadAll(fd, header.data(), header.size(), file_offset);
+  if (result) {
+    return result;
+  }
+
+  p = header.data();
+  uint32_t index_size = 0;
+  Get32(p, header.data() + header.size(), magic);
+  Get32(p, header.data() + header.size(), index_size);
+  if (magic != kSkippableMagic or
+      file_offset + 8 + index_size + table_size >
+          static_cast<uint64_t>(st.st_size)) {
+    LOG(kError) << archive << " has no file index";
+    return -EINVAL;
+  }
+
+  std::string index(index_size, '\0');
+  result = ReadAll(fd, index.data(), index.size(), file_offset + 8);
+  if (result) {
+    return result;
+  }
+
+  p = index.data();
+  end = p + index.size();
+  uint64_t count = 0;
+  if (index.size() < sizeof(kIndexMagic) or
+      std::memcmp(p, kIndexMagic, sizeof(kIndexMagic)) or
+      not Get64(p += sizeof(kIndexMagic), end, count)) {
+    LOG(kError) << archive << " has no file index";
+    return -EINVAL;
+  }
+
+  for (uint64_t i = 0; i < count; ++i) {
+    std::string name;
+    std::string link;
+    uint32_t mode = 0;
+    uint64_t size = 0;
+    uint64_t mtime = 0;
+    uint32_t extent_count = 0;
+
+    if (not GetString(p, end, name) or not Get32(p, end, mode) or
+        not Get64(p, end, size) or not Get64(p, end, mtime) or
+        not GetString(p, end, link) or not Get32(p, end, extent_count)) {
+      break;
+    }
+
+    const char* extents = p;
+    if (static_cast<uint64_t>(end - p) < extent_count * 24ull) {
+      break;
+    }
+    p += extent_count * 24ull;
+
+    if (name != path) {
+      continue;
+    }
+
+    if (not S_ISREG(mode)) {
+      LOG(kError) << path << " is not a regular file in " << archive;
+      return -EINVAL;
+    }
+
+    const int out = ::open(destination.c_str(),
+                           O_CREAT | O_TRUNC | O_WRONLY, mode & 07777);
+    if (out < 0) {
+      result = -errno;
+      LOG(kError) << "Failed to create file " << destination << ": error "
+                  << -result << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+
+    std::shared_ptr<void> scoped_out(nullptr, [out](void*) { ::close(out); });
+
+    // The frame last decompressed, as extents often share one
+    size_t cached = frames.size();
+    std::string compressed;
+    std::string data;
+
+    for (uint32_t e = 0; e < extent_count; ++e) {
+      uint64_t offset = 0;
+      uint64_t length = 0;
+      uint64_t stream = 0;
+      Get64(extents, end, offset);
+      Get64(extents, end, length);
+      Get64(extents, end, stream);
+
+      while (length) {
+        // Last frame starting at or before `stream`
+        auto frame = std::upper_bound(
+            frames.begin(), frames.end(), stream,
+            [](uint64_t stream, const Frame& frame) {
+              return stream < frame.stream;
+            });
+        if (frame == frames.begin()) {
+          return -EIO;
+        }
+        --frame;
+
+        const size_t number = frame - frames.begin();
+        if (number != cached) {
+          compressed.resize(frame->compressed);
+          data.resize(frame->size);
+          result = ReadAll(fd, compressed.data(), compressed.size(),
+                           frame->file);
+          if (result) {
+            return result;
+          }
+          const size_t n = ZSTD_decompress(data.data(), data.size(),
+                                           compressed.data(),
+                                           compressed.size());
+          if (ZSTD_isError(n) or n != data.size()) {
+            LOG(kError) << "Failed to decompress frame " << number << " of "
+                        << archive;
+            return -EIO;
+          }
+          cached = number;
+        }
+
+        const uint64_t skip = stream - frame->stream;
+        if (skip >= data.size()) {
+          return -EIO;
+        }
+        const size_t take = std::min<uint64_t>(length, data.size() - skip);
+
+        result = WriteAll(out, data.data() + skip, take, offset);
+        if (result) {
+          LOG(kError) << "Failed to write " << destination << ": error "
+                      << -result << " (" << ::strerror(-result) << ")";
+          return result;
+        }
+
+        offset += take;
+        stream += take;
+        length -= take;
+      }
+    }
+
+    const struct timespec times[2] = {{static_cast<time_t>(mtime), 0},
+                                      {static_cast<time_t>(mtime), 0}};
+    if (::ftruncate(out, size) or ::futimens(out, times)) {
+      result = -errno;
+      LOG(kError) << "Failed to set size of " << destination << ": error "
+                  << -result << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+    return 0;
+  }
+
+  LOG(kError) << path << " is not in " << archive;
+  return -ENOENT;
+}
@@ -0,0 +1,125 @@
+#ifndef TESTSNAPSHOT_ARCHIVE_H_
+#define TESTSNAPSHOT_ARCHIVE_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "small_file_reader.h"
+#include "thread_pool.h"
+
+// Compressed snapshot archive.
+//
+// File data is cut into frames of `frame_size` bytes, each compressed as
+// an independent zstd frame on a pool of workers and written out in
+// submission order, so the archive is an ordinary zstd stream. After the
+// data frames come two skippable frames: the file index, which maps every
+// file's data runs to offsets in the decompressed stream, and a seek table
+// in the zstd seekable format giving the size of every frame. A single
+// file can then be extracted by decompressing only the frames holding it.
+//
+// Small files are read through a SmallFileReader and packed together;
+// larger files are read with ReadSparse() by the caller's thread, so holes
+// take no space. Directories and symbolic links are recorded in the index.
+
+struct ArchiveOptions {
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t frame_size = 1 << 20;
+  int level = 3;
+  SmallFileOptions small_files;
+};
+
+struct ArchiveStats {
+  uint64_t files = 0;
+  uint64_t frames = 0;
+  uint64_t data_bytes = 0;        // Decompressed stream size
+  uint64_t compressed_bytes = 0;  // Archive size
+};
+
+class ArchiveWriter {
+ public:
+  ArchiveWriter(std::shared_ptr<ceph_mount_info> mount,
+                const ArchiveOptions& options);
+  ~ArchiveWriter();
+
+  ArchiveWriter(const ArchiveWriter&) = delete;
+  ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+  // Create the archive file at local path `path`.
+  int Open(const std::string& path);
+
+  // Add the entry at `path` from a walk. Thread safe; blocks while the
+  // compressors are behind.
+  int Add(const std::string& path, const struct ceph_statx& sb,
+          std::shared_ptr<Inode> inode);
+
+  // Write out everything pending, then the index and seek table.
+  int Finish(ArchiveStats* stats = nullptr);
+
+ private:
+  struct Extent {
+    uint64_t offset;  // In the file
+    uint64_t length;
+    uint64_t stream;  // In the decompressed stream
+  };
+
+  struct Record {
+    std::string path;
+    uint32_t mode = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::string link;
+    std::vector<Extent> extents;
+  };
+
+  int AddBatch(FileBatch& batch);
+  int AddLargeFile(Record& record, Inode* inode);
+  int AddRecord(Record record);
+
+  // Queue `data` as the next frames; `stream` is set to where it starts
+  // in the decompressed stream. Blocks while the compressors are behind.
+  int Submit(std::string data, uint64_t& stream);
+  void Compress(uint64_t sequence, std::string data);
+  void WriteFrames();
+  int WriteTrailer();
+
+  const std::shared_ptr<ceph_mount_info> mount_;
+  const ArchiveOptions options_;
+  int fd_ = -1;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  uint64_t submitted_ = 0;  // Frames handed to the pool
+  uint64_t written_ = 0;    // Frames written to the file
+  uint64_t stream_ = 0;     // Decompressed bytes submitted
+  std::map<uint64_t, std::string> compressed_;  // Waiting for their turn
+  std::vector<std::pair<uint32_t, uint32_t>> frames_;  // {compressed, size}
+  uint64_t file_bytes_ = 0;
+  int error_ = 0;
+
+  std::mutex index_mutex_;
+  std::vector<Record> index_;
+
+  std::mutex submit_mutex_;  // Serializes Submit() calls
+  std::mutex write_mutex_;   // Keeps frames in sequence order
+
+  ThreadPool pool_;
+  // Declared last: its callback feeds the pool above
+  SmallFileReader small_files_;
+};
+
+// Extract the file `path` from archive `archive` to local file
+// `destination`, decompressing only the frames that hold it.
+int ExtractFile(const std::string& archive, const std::string& path,
+                const std::string& destination);
+
+#endif  // TESTSNAPSHOT_ARCHIVE_H_
@@ -0,0 +1,285 @@
+#include "client.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+#include "inode_refs.h"
+#include "log.h"
+
+const std::filesystem::path config{"/etc/ceph/ceph.conf"};
+const std::string client_id{"admin"};
+const std::string client_uuid{"lx-2024-07-10"};
+
+int Mount(std::shared_ptr<ceph_mount_info>& mount,
+          std::shared_ptr<UserPerm>& user_perms) {
+  return Mount(mount, user_perms, "", client_uuid);
+}
+
+int Mount(std::shared_ptr<ceph_mount_info>& mount,
+          std::shared_ptr<UserPerm>& user_perms, const std::string& fs_name,
+          const std::string& uuid) {
+  namespace fs = std::filesystem;
+
+  if (not fs::exists(config) or not fs::is_regular_file(config)) {
+    LOG(kError) << "Unable to use " << config
+                << " as a configuration file for ceph";
+    return -EINVAL;
+  }
+
+  int result;
+
+  {  // Create the mount point
+    ceph_mount_info* cmount;
+    result = ceph_create(&cmount, client_id.c_str());
+    if (result) {
+      LOG(kError) << "Failed to create ceph mount: error " << -result << " ("
+                  << ::strerror(-result) << ")";
+      return result;
+    }
+
+    mount =
+        std::shared_ptr<ceph_mount_info>(cmount, [](ceph_mount_info* cmount) {
+          if (cmount) {
+            int result = ceph_unmount(cmount);
+            if (result) {
+              LOG(kError) << "Failed to unmount ceph mount: error " << -result
+                          << " (" << ::strerror(-result) << ")";
+            }
+
+            DropInodeRefs(cmount);
+
+            result = ceph_release(cmount);
+            if (result) {
+              LOG(kError) << "Failed to release ceph mount: error " << -result
+                          << " (" << ::strerror(-result) << ")";
+            }
+          }
+        });
+  }
+
+  // Read the configuration file
+  result = ceph_conf_read_file(mount.get(), config.c_str());
+  if (result) {
+    LOG(kError) << "Failed read configuration file " << config << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  // Process any environment variables
+  result = ceph_conf_parse_env(mount.get(), nullptr);
+  if (result) {
+    LOG(kError) << "Failed parse ceph environment variables: error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  result = ceph_conf_set(mount.get(), "debug_client", "1");
+  if (result) {
+    LOG(kError) << "Failed to set mount option debug_client value 1: error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  // Initialize the mount point
+  result = ceph_init(mount.get());
+  if (result) {
+    LOG(kError) << "Failed to initialize ceph mount point: error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  // Before reclaiming: the old session is looked up in the selected file
+  // system
+  if (not fs_name.empty()) {
+    result = ceph_select_filesystem(mount.get(), fs_name.c_str());
+    if (result) {
+      LOG(kError) << "Failed to select file system " << fs_name << ": error "
+                  << -result << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+  }
+
+  LOG(kInfo) << "Mounting ceph node";
+
+  ceph_set_session_timeout(mount.get(), 60);
+
+  result = ceph_start_reclaim(mount.get(), uuid.c_str(), CEPH_RECLAIM_RESET);
+  if (result == -ENOTRECOVERABLE) {
+    LOG(kError) << "Failed to start ceph reclaim";
+    return result;
+  } else if (result == -ENOENT) {
+    LOG(kWarn) << "Not an error - Failed to start ceph reclaim";
+  } else {
+    LOG(kInfo) << "Succeed on starting ceph reclaim";
+  }
+
+  ceph_finish_reclaim(mount.get());
+
+  ceph_set_uuid(mount.get(), uuid.c_str());
+
+  result = ceph_mount(mount.get(), nullptr);
+  if (result) {
+    LOG(kError) << "Failed to mount ceph: error " << -result << " ("
+                << ::strerror(-result) << ")";
+    return result;
+  }
+
+  {  // Get the user permissions
+    UserPerm* perms = ceph_mount_perms(mount.get());
+    if (not perms) {
+      result = -EIO;
+      LOG(kError) << "Failed get user perms: error " << -result << " ("
+                  << ::strerror(-result) << ")";
+      return result;
+    }
+
+    user_perms = std::shared_ptr<UserPerm>(perms, [](UserPerm*) {});
+  }
+
+  // Leave half of the client cache for the parents and dentries of what
+  // the tool pins, unless told otherwise
+  char cache_size[32];
+  if (const char* budget = std::getenv("TESTSNAPSHOT_INODE_BUDGET")) {
+    SetInodeBudget(mount.get(), std::strtoull(budget, nullptr, 10));
+  } else if (ceph_conf_get(mount.get(), "client_cache_size", cache_size,
+                           sizeof(cache_size)) == 0) {
+    SetInodeBudget(mount.get(), std::strtoull(cache_size, nullptr, 10) / 2);
+  }
+
+  return result;
+}
+
+using DirEntryCallback =
+    std::function<bool(const std::string& name, const struct ceph_statx& sb,
+                       std::shared_ptr<Inode>)>;
+
+int ReadDir(std::shared_ptr<ceph_mount_info> mount,
+            std::shared_ptr<Inode> parent, DirEntryCallback callback) {
+  struct ceph_dir_result* dh_parent = nullptr;
+
+  int result = ceph_ll_opendir(mount.get(), parent.get(), &dh_parent,
+                               ceph_mount_perms(mount.get()));
+  if (result) {
+    LOG(kError) << "Failed to open directory: error " << -result << " ("
+                << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<ceph_dir_result> scoped_dh_parent(
+      dh_parent,
+      [mount](ceph_dir_result* dh) { ceph_ll_releasedir(mount.get(), dh); });
+
+  const std::shared_ptr<InodeRefs> refs = GetInodeRefs(mount.get());
+  bool done = false;
+
+  do {
+    dirent entry;
+    struct ceph_statx sb;
+    struct Inode* ceph_inode;
+
+    result = ceph_readdirplus_r(mount.get(), dh_parent, &entry, &sb,
+                                CEPH_STATX_ALL_STATS, 0, &ceph_inode);
+    if (result < 0) {
+      LOG(kError) << "Failed to read directory: error " << -result << " ("
+                  << ::strerror(-result) << ")";
+      break;
+    }
+
+    if (result == 0) {
+      break;
+    }
+
+    auto eh = ScopeInode(mount, refs, ceph_inode, sb);
+
+    const std::string entry_name(entry.d_name);
+
+    done = not callback(entry_name, sb, eh);
+  } while (not done);
+
+  return result;
+}
+
+int WalkPath(std::shared_ptr<ceph_mount_info> mount, const std::string& path,
+             std::shared_ptr<Inode>& scoped_inode, struct ceph_statx& sb) {
+  Inode* inode = nullptr;
+
+  int result = ceph_ll_walk(mount.get(), path.c_str(), &inode, &sb,
+                            CEPH_STATX_ALL_STATS, 0,
+                            ceph_mount_perms(mount.get()));
+  if (result) {
+    LOG(kError) << "Failed to walk ceph path " << path << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  scoped_inode = ScopeInode(mount, inode, sb);
+  return 0;
+}
+
+int GetXattr(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+             const std::string& name, std::string& value) {
+  int result = ceph_ll_getxattr(mount.get(), inode, name.c_str(), nullptr, 0,
+                                ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    return result;
+  }
+
+  value.resize(result);
+
+  result = ceph_ll_getxattr(mount.get(), inode, name.c_str(), value.data(),
+                            value.size(), ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    return result;
+  }
+
+  value.resize(result);
+  return 0;
+}
+
+int GetXattrs(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+              std::vector<std::pair<std::string, std::string>>& xattrs) {
+  size_t list_size = 0;
+
+  int result = ceph_ll_listxattr(mount.get(), inode, nullptr, 0, &list_size,
+                                 ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    return result;
+  }
+
+  std::string names(list_size, '\0');
+
+  result = ceph_ll_listxattr(mount.get(), inode, names.data(), names.size(),
+                             &list_size, ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    return result;
+  }
+
+  xattrs.clear();
+
+  // The list is a sequence of NUL terminated names
+  for (size_t pos = 0; pos < list_size;) {
+    const std::string name(names.c_str() + pos);
+    pos += name.size() + 1;
+    if (name.empty()) {
+      continue;
+    }
+
+    std::string value;
+    result = GetXattr(mount, inode, name, value);
+    if (result == -ENODATA) {
+      continue;  // Removed since listed
+    }
+    if (result < 0) {
+      return result;
+    }
+
+    xattrs.emplace_back(name, std::move(value));
+  }
+
+  std::sort(xattrs.begin(), xattrs.end());
+  return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef TESTSNAPSHOT_CLIENT_H_
+#define TESTSNAPSHOT_CLIENT_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// libcephfs only forward declares these
+typedef struct inodeno_t {
+  uint64_t val;
+} inodeno_t;
+
+typedef struct snapid_t {
+  uint64_t val;
+} snapid_t;
+
+typedef struct vinodeno_t {
+  inodeno_t ino;
+  snapid_t snapid;
+} vinodeno_t;
+
+// Session uuid of the default mount; other mounts derive theirs from it.
+extern const std::string client_uuid;
+
+int Mount(std::shared_ptr<ceph_mount_info>& mount,
+          std::shared_ptr<UserPerm>& user_perms);
+
+// Mount file system `fs_name` (the default one when empty) as client
+// `uuid`, reclaiming the session a previous client with that uuid left.
+int Mount(std::shared_ptr<ceph_mount_info>& mount,
+          std::shared_ptr<UserPerm>& user_perms, const std::string& fs_name,
+          const std::string& uuid);
+
+using DirEntryCallback =
+    std::function<bool(const std::string& name, const struct ceph_statx& sb,
+                       std::shared_ptr<Inode>)>;
+
+int ReadDir(std::shared_ptr<ceph_mount_info> mount,
+            std::shared_ptr<Inode> parent, DirEntryCallback callback);
+
+// Resolve `path` relative to the mount root, pinning the inode.
+int WalkPath(std::shared_ptr<ceph_mount_info> mount, const std::string& path,
+             std::shared_ptr<Inode>& scoped_inode, struct ceph_statx& sb);
+
+// Read the whole value of xattr `name` into `value`.
+int GetXattr(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+             const std::string& name, std::string& value);
+
+// Read every xattr of `inode` as sorted {name, value} pairs.
+int GetXattrs(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+              std::vector<std::pair<std::string, std::string>>& xattrs);
+
+#endif  // TESTSNAPSHOT_CLIENT_H_
@@ -0,0 +1,126 @@
+#include "digest.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "log.h"
+#include "sparse.h"
+
+namespace {
+
+constexpr uint64_t kMul1 = 0xff51afd7ed558ccdull;
+constexpr uint64_t kMul2 = 0xc4ceb9fe1a85ec53ull;
+
+uint64_t Rotl(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+}  // namespace
+
+void Digest::Mix(uint64_t word) {
+  state_ ^= Rotl(word * kMul1, 31) * kMul2;
+  state_ = Rotl(state_, 27) * 5 + 0x52dce729;
+}
+
+void Digest::Update(const void* data, size_t size) {
+  const auto* bytes = static_cast<const unsigned char*>(data);
+  length_ += size;
+
+  if (tail_size_) {
+    const size_t n = std::min(size, sizeof(tail_) - tail_size_);
+    std::memcpy(tail_ + tail_size_, bytes, n);
+    tail_size_ += n;
+    bytes += n;
+    size -= n;
+    if (tail_size_ < sizeof(tail_)) {
+      return;
+    }
+
+    uint64_t word;
+    std::memcpy(&word, tail_, sizeof(word));
+    Mix(word);
+    tail_size_ = 0;
+  }
+
+  for (; size >= sizeof(uint64_t); bytes += 8, size -= 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    Mix(word);
+  }
+
+  std::memcpy(tail_, bytes, size);
+  tail_size_ = size;
+}
+
+uint64_t Digest::Finish() const {
+  uint64_t state = state_;
+  uint64_t word = 0;
+  std::memcpy(&word, tail_, tail_size_);
+  state ^= Rotl(word * kMul1, 31) * kMul2;
+  state ^= length_;
+
+  state ^= state >> 33;
+  state *= kMul1;
+  state ^= state >> 33;
+  state *= kMul2;
+  state ^= state >> 33;
+  return state;
+}
+
+std::string Digest::Hex(uint64_t digest) {
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx",
+                static_cast<unsigned long long>(digest));
+  return buf;
+}
+
+int DigestFile(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+               uint64_t& digest) {
+  struct ceph_statx sb;
+
+  int result = ceph_ll_getattr(mount.get(), inode, &sb, CEPH_STATX_SIZE, 0,
+                               ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    LOG(kError) << "Failed to stat file for digest"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  Fh* fh = nullptr;
+  result = ceph_ll_open(mount.get(), inode, O_RDONLY, &fh,
+                        ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    LOG(kError) << "Failed to open file for digest"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<Fh> scoped_fh(
+      fh, [mount](Fh* fh) { ceph_ll_close(mount.get(), fh); });
+
+  Digest hash;
+  uint64_t next = 0;
+
+  // Holes are never read; a skipped range is hashed as its bounds instead
+  result = ReadSparse(mount, fh, sb.stx_size,
+                      [&hash, &next](uint64_t offset, const char* data,
+                                     size_t size) {
+                        if (offset != next) {
+                          const uint64_t gap[2] = {next, offset};
+                          hash.Update(gap, sizeof(gap));
+                        }
+                        hash.Update(data, size);
+                        next = offset + size;
+                        return 0;
+                      });
+  if (result) {
+    return result;
+  }
+
+  hash.Update(&sb.stx_size, sizeof(sb.stx_size));
+  digest = hash.Finish();
+  return 0;
+}
@@ -0,0 +1,254 @@
+#include "frontier.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "log.h"
+
+namespace {
+
+// Spilled entries are written and read back in chunks of this size
+constexpr size_t kSpillChunk = 1 << 20;
+
+template <typename T>
+void Put(std::string& out, const T& value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool Get(const char*& data, const char* end, T& value) {
+  if (static_cast<size_t>(end - data) < sizeof(value)) {
+    return false;
+  }
+  std::memcpy(&value, data, sizeof(value));
+  data += sizeof(value);
+  return true;
+}
+
+}  // namespace
+
+void EncodePendingDir(const PendingDir& dir, std::string& out) {
+  Put(out, dir.vino.ino.val);
+  Put(out, dir.vino.snapid.val);
+  Put(out, dir.offset);
+  Put(out, static_cast<uint32_t>(dir.path.size()));
+  out.append(dir.path);
+}
+
+bool DecodePendingDir(const char*& data, const char* end, PendingDir& dir) {
+  const char* p = data;
+  uint32_t length = 0;
+
+  if (not Get(p, end, dir.vino.ino.val) or
+      not Get(p, end, dir.vino.snapid.val) or not Get(p, end, dir.offset) or
+      not Get(p, end, length) or static_cast<size_t>(end - p) < length) {
+    return false;
+  }
+
+  dir.path.assign(p, length);
+  data = p + length;
+  return true;
+}
+
+SpillFile::~SpillFile() { ::close(fd); }
+
+Frontier::Frontier(size_t memory_budget, std::string spill_dir)
+    : memory_budget_(memory_budget), spill_dir_(std::move(spill_dir)) {}
+
+size_t Frontier::Cost(const PendingDir& dir) {
+  return sizeof(PendingDir) + dir.path.size();
+}
+
+int Frontier::PushBack(PendingDir dir) {
+  const size_t cost = Cost(dir);
+
+  if (spilled_ == 0 and memory_bytes_ + cost <= memory_budget_) {
+    memory_bytes_ += cost;
+    memory_.push_back(std::move(dir));
+    return 0;
+  }
+
+  // Once spilling, everything goes to the file to keep FIFO order
+  EncodePendingDir(dir, spill_buffer_);
+  ++spilled_;
+
+  if (spill_buffer_.size() >= kSpillChunk) {
+    return FlushSpill();
+  }
+  return 0;
+}
+
+void Frontier::PushFront(PendingDir dir) {
+  memory_bytes_ += Cost(dir);
+  memory_.push_front(std::move(dir));
+}
+
+int Frontier::PopFront(PendingDir& dir) {
+  if (memory_.empty()) {
+    int result = Refill();
+    if (result < 0) {
+      return result;
+    }
+    if (memory_.empty()) {
+      return 0;
+    }
+  }
+
+  dir = std::move(memory_.front());
+  memory_.pop_front();
+  memory_bytes_ -= Cost(dir);
+  return 1;
+}
+
+int Frontier::OpenSpill() {
+  std::string path = spill_dir_ + "/testsnapshot-frontier-XXXXXX";
+
+  const int fd = ::mkstemp(path.data());
+  if (fd < 0) {
+    const int result = -errno;
+    LOG(kError) << "Failed to create frontier spill file in " << spill_dir_
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  // Only reachable through the descriptor, so it goes away with us
+  ::unlink(path.c_str());
+  spill_ = std::make_shared<const SpillFile>(fd);
+
+  LOG(kInfo) << "Frontier exceeded " << memory_budget_
+             << " bytes, spilling to " << spill_dir_;
+  return 0;
+}
+
+int Frontier::FlushSpill() {
+  if (spill_buffer_.empty()) {
+    return 0;
+  }
+
+  if (not spill_) {
+    int result = OpenSpill();
+    if (result) {
+      return result;
+    }
+  }
+
+  size_t written = 0;
+  while (written < spill_buffer_.size()) {
+    const ssize_t n =
+        ::pwrite(spill_->fd, spill_buffer_.data() + written,
+                 spill_buffer_.size() - written, spill_write_ + written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      const int result = -errno;
+      LOG(kError) << "Failed to write frontier spill file: error " << -result
+                  << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+    written += n;
+  }
+
+  spill_write_ += written;
+  spill_buffer_.clear();
+  return 0;
+}
+
+int Frontier::Refill() {
+  if (spilled_ == 0) {
+    return 0;
+  }
+
+  std::string chunk;
+
+  if (spill_read_ == spill_write_) {
+    // Everything left is still buffered
+    chunk.swap(spill_buffer_);
+  } else {
+    chunk.resize(std::min<uint64_t>(kSpillChunk, spill_write_ - spill_read_));
+
+    const ssize_t n =
+        ::pread(spill_->fd, chunk.data(), chunk.size(), spill_read_);
+    if (n < 0) {
+      const int result = -errno;
+      LOG(kError) << "Failed to read frontier spill file: error " << -result
+                  << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+    chunk.resize(n);
+  }
+
+  const char* data = chunk.data();
+  const char* end = data + chunk.size();
+  PendingDir dir;
+
+  while (DecodePendingDir(data, end, dir)) {
+    memory_bytes_ += Cost(dir);
+    memory_.push_back(std::move(dir));
+    --spilled_;
+  }
+
+  if (spill_read_ != spill_write_) {
+    spill_read_ += data - chunk.data();
+  } else if (data != end) {
+    LOG(kError) << "Corrupt frontier spill buffer";
+    return -EIO;
+  }
+
+  // Drained: give the disk space back, unless a snapshot still has to read
+  // the file. Snapshot() is serialized with this like every other call, so
+  // a count of one cannot go up meanwhile.
+  if (spill_read_ == spill_write_ and spill_ and spill_.use_count() == 1) {
+    if (::ftruncate(spill_->fd, 0) == 0) {
+      spill_read_ = spill_write_ = 0;
+    }
+  }
+
+  return 0;
+}
+
+FrontierSnapshot Frontier::Snapshot() const {
+  FrontierSnapshot snapshot;
+
+  snapshot.size_ = size();
+  for (const auto& dir : memory_) {
+    EncodePendingDir(dir, snapshot.memory_);
+  }
+  if (spill_read_ != spill_write_) {
+    snapshot.spill_ = spill_;
+    snapshot.spill_read_ = spill_read_;
+    snapshot.spill_write_ = spill_write_;
+  }
+  snapshot.spill_buffer_ = spill_buffer_;
+  return snapshot;
+}
+
+int FrontierSnapshot::WriteTo(FILE* file) const {
+  if (std::fwrite(memory_.data(), 1, memory_.size(), file) != memory_.size()) {
+    return -errno;
+  }
+
+  std::vector<char> chunk(kSpillChunk);
+  for (uint64_t pos = spill_read_; pos < spill_write_;) {
+    const size_t size = std::min<uint64_t>(chunk.size(), spill_write_ - pos);
+    const ssize_t n = ::pread(spill_->fd, chunk.data(), size, pos);
+    if (n <= 0) {
+      return n < 0 ? -errno : -EIO;
+    }
+    if (std::fwrite(chunk.data(), 1, n, file) != static_cast<size_t>(n)) {
+      return -errno;
+    }
+    pos += n;
+  }
+
+  if (std::fwrite(spill_buffer_.data(), 1, spill_buffer_.size(), file) !=
+      spill_buffer_.size()) {
+    return -errno;
+  }
+
+  return 0;
+}
@@ -0,0 +1,106 @@
+#ifndef TESTSNAPSHOT_FRONTIER_H_
+#define TESTSNAPSHOT_FRONTIER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "client.h"
+
+// A directory waiting to be read by the walker.
+struct PendingDir {
+  vinodeno_t vino;
+  std::string path;
+  int64_t offset = 0;  // ceph_telldir() position to resume reading from
+};
+
+// Append the on-disk encoding of `dir`, shared by spill files and walk
+// checkpoints.
+void EncodePendingDir(const PendingDir& dir, std::string& out);
+
+// Decode one record from [data, end), advancing `data`. Returns false if
+// the range does not hold a whole record.
+bool DecodePendingDir(const char*& data, const char* end, PendingDir& dir);
+
+// The spill file's descriptor, closed once neither the frontier nor a
+// snapshot of it uses the file.
+struct SpillFile {
+  explicit SpillFile(int fd) : fd(fd) {}
+  ~SpillFile();
+
+  SpillFile(const SpillFile&) = delete;
+  SpillFile& operator=(const SpillFile&) = delete;
+
+  const int fd;
+};
+
+// The entries of a Frontier at the time of Frontier::Snapshot(). Those in
+// memory are copied; spilled ones are read from the spill file when written,
+// which needs no lock against the frontier changing meanwhile.
+class FrontierSnapshot {
+ public:
+  uint64_t size() const { return size_; }
+
+  // Write every entry, in order, using the EncodePendingDir() format.
+  int WriteTo(FILE* file) const;
+
+ private:
+  friend class Frontier;
+
+  uint64_t size_ = 0;
+  std::string memory_;  // Encoded entries held in memory
+  std::shared_ptr<const SpillFile> spill_;
+  uint64_t spill_read_ = 0;
+  uint64_t spill_write_ = 0;
+  std::string spill_buffer_;
+};
+
+// FIFO of pending directories with a memory budget. Once the entries held
+// in memory reach the budget, further entries are appended to an unlinked
+// temporary file and read back sequentially as memory drains, so memory
+// stays flat however wide the tree is. Not thread safe.
+class Frontier {
+ public:
+  Frontier(size_t memory_budget, std::string spill_dir);
+
+  Frontier(const Frontier&) = delete;
+  Frontier& operator=(const Frontier&) = delete;
+
+  bool empty() const { return size() == 0; }
+  uint64_t size() const { return memory_.size() + spilled_; }
+  uint64_t spilled() const { return spilled_; }
+
+  int PushBack(PendingDir dir);
+  // For putting back a directory that was being read; never spills.
+  void PushFront(PendingDir dir);
+  // Returns 1 and fills `dir`, 0 when empty, or a negative error.
+  int PopFront(PendingDir& dir);
+
+  // Costs a copy of the entries in memory, at most the memory budget. The
+  // spill file is not truncated for reuse while a snapshot holds it.
+  FrontierSnapshot Snapshot() const;
+
+ private:
+  static size_t Cost(const PendingDir& dir);
+
+  int OpenSpill();
+  int FlushSpill();
+  int Refill();
+
+  const size_t memory_budget_;
+  const std::string spill_dir_;
+
+  std::deque<PendingDir> memory_;
+  size_t memory_bytes_ = 0;
+
+  std::shared_ptr<const SpillFile> spill_;
+  std::string spill_buffer_;  // Encoded entries not yet written
+  uint64_t spill_read_ = 0;   // File offset of the oldest spilled entry
+  uint64_t spill_write_ = 0;  // File offset where spill_buffer_ goes
+  uint64_t spilled_ = 0;      // Entries in the file and spill_buffer_
+};
+
+#endif  // TESTSNAPSHOT_FRONTIER_H_
@@ -0,0 +1,203 @@
+#include "history.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <future>
+
+#include "client.h"
+#include "digest.h"
+#include "inode_refs.h"
+#include "log.h"
+#include "thread_pool.h"
+
+namespace {
+
+InodeVersion ReadVersion(std::shared_ptr<ceph_mount_info> mount, uint64_t ino,
+                         uint64_t snapid, const std::string& snap_name,
+                         bool digest) {
+  InodeVersion version;
+  version.snapid = snapid;
+  version.snap_name = snap_name;
+
+  const vinodeno vino = {ino, snapid};
+  Inode* inode = nullptr;
+
+  WaitForInodeBudget(mount.get());
+  version.result = ceph_ll_lookup_vino(mount.get(), vino, &inode);
+  if (version.result) {
+    if (version.result != -ENOENT and version.result != -ESTALE) {
+      LOG(kError) << "Failed to lookup inode {" << ino << ", " << snapid
+                  << "} in snapshot " << snap_name << ": error "
+                  << -version.result << " (" << ::strerror(-version.result)
+                  << ")";
+    }
+    return version;
+  }
+
+  std::shared_ptr<Inode> scoped_inode = ScopeInode(mount, inode, vino);
+
+  version.result =
+      ceph_ll_getattr(mount.get(), inode, &version.sb, CEPH_STATX_ALL_STATS, 0,
+                      ceph_mount_perms(mount.get()));
+  if (version.result < 0) {
+    LOG(kError) << "Failed to stat inode {" << ino << ", " << snapid
+                << "}: error " << -version.result << " ("
+                << ::strerror(-version.result) << ")";
+    return version;
+  }
+
+  version.result = GetXattrs(mount, inode, version.xattrs);
+  if (version.result < 0) {
+    LOG(kError) << "Failed to read xattrs of inode {" << ino << ", " << snapid
+                << "}: error " << -version.result << " ("
+                << ::strerror(-version.result) << ")";
+    return version;
+  }
+
+  if (digest and S_ISREG(version.sb.stx_mode)) {
+    version.result = DigestFile(mount, inode, version.digest);
+    version.has_digest = version.result == 0;
+  }
+
+  return version;
+}
+
+bool SameVersion(const InodeVersion& a, const InodeVersion& b) {
+  if (a.result or b.result) {
+    return a.result == b.result;
+  }
+
+  return a.sb.stx_mode == b.sb.stx_mode and a.sb.stx_uid == b.sb.stx_uid and
+         a.sb.stx_gid == b.sb.stx_gid and a.sb.stx_size == b.sb.stx_size and
+         a.sb.stx_mtime.tv_sec == b.sb.stx_mtime.tv_sec and
+         a.sb.stx_mtime.tv_nsec == b.sb.stx_mtime.tv_nsec and
+         a.xattrs == b.xattrs and a.has_digest == b.has_digest and
+         a.digest == b.digest;
+}
+}  // namespace
+
+int ReadHistory(std::shared_ptr<ceph_mount_info> mount, const std::string& path,
+                const HistoryOptions& options,
+                std::vector<VersionGroup>& history) {
+  std::shared_ptr<Inode> scoped_inode;
+  struct ceph_statx sb;
+
+  int result = WalkPath(mount, path, scoped_inode, sb);
+  if (result) {
+    return result;
+  }
+
+  // Snapshots are listed under directories, so a file uses its parent's
+  std::shared_ptr<Inode> scoped_dir = scoped_inode;
+  if (not S_ISDIR(sb.stx_mode)) {
+    std::string parent = std::filesystem::path(path).parent_path().string();
+    if (parent.empty()) {
+      parent = "/";
+    }
+
+    struct ceph_statx parent_sb;
+    result = WalkPath(mount, parent, scoped_dir, parent_sb);
+    if (result) {
+      return result;
+    }
+  }
+
+  Inode* snap_dir_inode = nullptr;
+  struct ceph_statx snap_dir_sb;
+
+  result = ceph_ll_lookup(mount.get(), scoped_dir.get(), ".snap",
+                          &snap_dir_inode, &snap_dir_sb, CEPH_STATX_INO, 0,
+                          ceph_mount_perms(mount.get()));
+  if (result) {
+    LOG(kError) << "Failed to lookup .snap of " << path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<Inode> scoped_snap_dir =
+      ScopeInode(mount, snap_dir_inode, snap_dir_sb);
+
+  std::vector<std::pair<uint64_t, std::string>> snaps;
+
+  result = ReadDir(mount, scoped_snap_dir,
+                   [&snaps](const std::string& name, const struct ceph_statx& sb,
+                            std::shared_ptr<Inode>) {
+                     if (name != "." and name != "..") {
+                       snaps.emplace_back(sb.stx_dev, name);
+                     }
+                     return true;
+                   });
+  if (result < 0) {
+    return result;
+  }
+
+  // One wave: every snapshot is resolved concurrently
+  std::vector<std::future<InodeVersion>> futures;
+  {
+    ThreadPool pool(std::max<size_t>(1, std::min(options.threads, snaps.size())));
+
+    futures.reserve(snaps.size());
+    for (const auto& [snapid, name] : snaps) {
+      futures.push_back(pool.Submit(
+          [mount, ino = sb.stx_ino, snapid = snapid, name = name,
+           digest = options.digest] {
+            return ReadVersion(mount, ino, snapid, name, digest);
+          }));
+    }
+  }
+
+  std::vector<InodeVersion> versions;
+  versions.reserve(futures.size());
+  for (auto& future : futures) {
+    versions.push_back(future.get());
+  }
+
+  // Snapshot ids grow with time
+  std::sort(versions.begin(), versions.end(),
+            [](const InodeVersion& a, const InodeVersion& b) {
+              return a.snapid < b.snapid;
+            });
+
+  history.clear();
+  for (auto& version : versions) {
+    if (history.empty() or not SameVersion(history.back().version, version)) {
+      history.push_back({version, {}});
+    }
+    history.back().snaps.emplace_back(version.snapid, version.snap_name);
+  }
+
+  return 0;
+}
+
+void PrintHistory(const std::string& path,
+                  const std::vector<VersionGroup>& history) {
+  LOG(kInfo) << path << ": " << history.size() << " distinct versions";
+
+  for (size_t i = 0; i < history.size(); ++i) {
+    const InodeVersion& version = history[i].version;
+    const auto& snaps = history[i].snaps;
+
+    std::string names;
+    for (const auto& snap : snaps) {
+      names += (names.empty() ? "" : ",") + snap.second;
+    }
+
+    if (version.result) {
+      LOG(kInfo) << "  version " << i << " snapids [" << snaps.front().first
+                 << ".." << snaps.back().first << "] (" << names
+                 << "): unavailable, error " << -version.result << " ("
+                 << ::strerror(-version.result) << ")";
+      continue;
+    }
+
+    LOG(kInfo) << "  version " << i << " snapids [" << snaps.front().first
+               << ".." << snaps.back().first << "] (" << names
+               << "): size " << version.sb.stx_size << " mtime "
+               << version.sb.stx_mtime.tv_sec << "." << version.sb.stx_mtime.tv_nsec
+               << " xattrs " << version.xattrs.size() << " digest "
+               << (version.has_digest ? Digest::Hex(version.digest) : "-");
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef TESTSNAPSHOT_HISTORY_H_
+#define TESTSNAPSHOT_HISTORY_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// One snapshot version of an inode.
+struct InodeVersion {
+  uint64_t snapid = 0;
+  std::string snap_name;
+  // 0, or the error from resolving {ino, snapid}; -ENOENT and -ESTALE mean
+  // the inode did not exist when the snapshot was taken.
+  int result = 0;
+  struct ceph_statx sb = {};
+  std::vector<std::pair<std::string, std::string>> xattrs;
+  bool has_digest = false;
+  uint64_t digest = 0;
+};
+
+// Consecutive snapshots in which the inode did not change.
+struct VersionGroup {
+  InodeVersion version;
+  std::vector<std::pair<uint64_t, std::string>> snaps;
+};
+
+struct HistoryOptions {
+  size_t threads = 16;
+  bool digest = false;
+};
+
+// Build the version history of `path` (relative to the mount root) across
+// every snapshot listed in the .snap directory covering it. All {ino,
+// snapid} lookups are issued at once on a thread pool.
+int ReadHistory(std::shared_ptr<ceph_mount_info> mount, const std::string& path,
+                const HistoryOptions& options,
+                std::vector<VersionGroup>& history);
+
+void PrintHistory(const std::string& path,
+                  const std::vector<VersionGroup>& history);
+
+#endif  // TESTSNAPSHOT_HISTORY_H_
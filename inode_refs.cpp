@@ -0,0 +1,227 @@
+#include "inode_refs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "log.h"
+
+namespace {
+
+using Vino = std::pair<uint64_t, uint64_t>;
+
+struct VinoHash {
+  size_t operator()(const Vino& vino) const {
+    return std::hash<uint64_t>()(vino.first * 0x9e3779b97f4a7c15ull ^
+                                 vino.second);
+  }
+};
+
+// Enough that walker threads pinning entries rarely meet on one
+constexpr size_t kPinShards = 64;
+
+}  // namespace
+
+class InodeRefs {
+ public:
+  void Pin(const Vino& vino);
+  void Unpin(const Vino& vino);
+
+  bool Under() const {
+    const size_t budget = budget_.load();
+    return budget == 0 or inodes_.load() < budget;
+  }
+
+  void SetBudget(size_t budget);
+  bool Wait(std::chrono::milliseconds max_wait);
+  InodeRefStats Stats() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<Vino, uint32_t, VinoHash> pins;
+  };
+
+  Shard& ShardOf(const Vino& vino) {
+    return shards_[VinoHash()(vino) % kPinShards];
+  }
+
+  Shard shards_[kPinShards];
+
+  std::atomic<size_t> inodes_{0};
+  std::atomic<size_t> references_{0};
+  std::atomic<size_t> peak_inodes_{0};
+  std::atomic<size_t> budget_{0};
+  std::atomic<uint64_t> deferrals_{0};
+
+  // Only taken to wait for the budget, or to wake such waiters
+  std::mutex wait_mutex_;
+  std::condition_variable wait_cv_;
+  std::atomic<size_t> waiters_{0};
+};
+
+void InodeRefs::Pin(const Vino& vino) {
+  bool first;
+  {
+    Shard& shard = ShardOf(vino);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    first = ++shard.pins[vino] == 1;
+  }
+
+  ++references_;
+  if (first) {
+    const size_t inodes = ++inodes_;
+    size_t peak = peak_inodes_.load();
+    while (inodes > peak and
+           not peak_inodes_.compare_exchange_weak(peak, inodes)) {
+    }
+  }
+}
+
+void InodeRefs::Unpin(const Vino& vino) {
+  bool last;
+  {
+    Shard& shard = ShardOf(vino);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto pin = shard.pins.find(vino);
+    last = --pin->second == 0;
+    if (last) {
+      shard.pins.erase(pin);
+    }
+  }
+
+  --references_;
+  if (last) {
+    --inodes_;
+    // A waiter registers before checking the count, so either it sees the
+    // decrement or it is seen here
+    if (waiters_.load() and Under()) {
+      std::lock_guard<std::mutex> lock(wait_mutex_);
+      wait_cv_.notify_all();
+    }
+  }
+}
+
+void InodeRefs::SetBudget(size_t budget) {
+  budget_ = budget;
+  std::lock_guard<std::mutex> lock(wait_mutex_);
+  wait_cv_.notify_all();
+}
+
+bool InodeRefs::Wait(std::chrono::milliseconds max_wait) {
+  if (Under()) {
+    return true;
+  }
+
+  ++deferrals_;
+
+  std::unique_lock<std::mutex> lock(wait_mutex_);
+  ++waiters_;
+  const bool under =
+      wait_cv_.wait_for(lock, max_wait, [this] { return Under(); });
+  --waiters_;
+  if (under) {
+    return true;
+  }
+
+  LOG(kWarn) << "Still " << inodes_.load()
+             << " inodes pinned after waiting " << max_wait.count()
+             << "ms for the budget of " << budget_.load();
+  return false;
+}
+
+InodeRefStats InodeRefs::Stats() const {
+  InodeRefStats stats;
+  stats.inodes = inodes_;
+  stats.references = references_;
+  stats.peak_inodes = peak_inodes_;
+  stats.deferrals = deferrals_;
+  stats.budget = budget_;
+  return stats;
+}
+
+namespace {
+
+std::mutex accounts_mutex;
+std::unordered_map<ceph_mount_info*, std::shared_ptr<InodeRefs>> accounts;
+
+}  // namespace
+
+std::shared_ptr<InodeRefs> GetInodeRefs(ceph_mount_info* mount) {
+  std::lock_guard<std::mutex> lock(accounts_mutex);
+  auto& refs = accounts[mount];
+  if (not refs) {
+    refs = std::make_shared<InodeRefs>();
+  }
+  return refs;
+}
+
+std::shared_ptr<Inode> ScopeInode(std::shared_ptr<ceph_mount_info> mount,
+                                  const std::shared_ptr<InodeRefs>& refs,
+                                  Inode* inode, const vinodeno_t& vino) {
+  const Vino key = std::make_pair(vino.ino.val, vino.snapid.val);
+  refs->Pin(key);
+
+  return std::shared_ptr<Inode>(inode, [mount, refs, key](Inode* inode) {
+    ceph_ll_put(mount.get(), inode);
+    refs->Unpin(key);
+  });
+}
+
+std::shared_ptr<Inode> ScopeInode(std::shared_ptr<ceph_mount_info> mount,
+                                  const std::shared_ptr<InodeRefs>& refs,
+                                  Inode* inode, const struct ceph_statx& sb) {
+  const vinodeno_t vino = {{sb.stx_ino}, {sb.stx_dev}};
+  return ScopeInode(mount, refs, inode, vino);
+}
+
+std::shared_ptr<Inode> ScopeInode(std::shared_ptr<ceph_mount_info> mount,
+                                  Inode* inode, const vinodeno_t& vino) {
+  return ScopeInode(mount, GetInodeRefs(mount.get()), inode, vino);
+}
+
+std::shared_ptr<Inode> ScopeInode(std::shared_ptr<ceph_mount_info> mount,
+                                  Inode* inode, const struct ceph_statx& sb) {
+  return ScopeInode(mount, GetInodeRefs(mount.get()), inode, sb);
+}
+
+void SetInodeBudget(ceph_mount_info* mount, size_t budget) {
+  GetInodeRefs(mount)->SetBudget(budget);
+}
+
+bool WaitForInodeBudget(InodeRefs& refs, std::chrono::milliseconds max_wait) {
+  return refs.Wait(max_wait);
+}
+
+bool WaitForInodeBudget(ceph_mount_info* mount,
+                        std::chrono::milliseconds max_wait) {
+  return GetInodeRefs(mount)->Wait(max_wait);
+}
+
+InodeRefStats GetInodeRefStats(ceph_mount_info* mount) {
+  return GetInodeRefs(mount)->Stats();
+}
+
+void LogInodeRefs(std::shared_ptr<ceph_mount_info> mount,
+                  const std::string& name) {
+  char cache_size[32] = "unknown";
+  ceph_conf_get(mount.get(), "client_cache_size", cache_size,
+                sizeof(cache_size));
+
+  const InodeRefStats stats = GetInodeRefStats(mount.get());
+  LOG(kInfo) << "Inodes pinned" << (name.empty() ? "" : " on " + name)
+             << ": " << stats.inodes << " (" << stats.references
+             << " references), peak " << stats.peak_inodes << ", budget "
+             << stats.budget << ", client_cache_size " << cache_size << ", "
+             << stats.deferrals << " deferrals";
+}
+
+void DropInodeRefs(ceph_mount_info* mount) {
+  std::lock_guard<std::mutex> lock(accounts_mutex);
+  accounts.erase(mount);
+}
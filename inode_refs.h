@@ -0,0 +1,78 @@
+#ifndef TESTSNAPSHOT_INODE_REFS_H_
+#define TESTSNAPSHOT_INODE_REFS_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "client.h"
+
+// Accounting of the Inode references the tool holds.
+//
+// Every reference libcephfs hands out pins an inode in the client cache
+// until ceph_ll_put(). Pins are counted per mount by {ino, snapid}; when
+// more distinct inodes are pinned than the mount's budget, work that would
+// pin more is deferred until others are released. This keeps the client
+// cache below client_cache_size, past which the MDS starts recalling caps.
+//
+// The pins are spread over sharded maps and the totals kept in atomics, so
+// parallel walks do not serialize on the accounting. Hot paths resolve the
+// mount's InodeRefs once with GetInodeRefs() and pass it in; the overloads
+// without it look it up in a process wide map on every call.
+
+class InodeRefs;
+
+// The accounting of `mount`, created on first use.
+std::shared_ptr<InodeRefs> GetInodeRefs(ceph_mount_info* mount);
+
+// Take ownership of `inode`, a reference to `vino` returned by libcephfs.
+// The last copy of the result puts the reference.
+std::shared_ptr<Inode> ScopeInode(std::shared_ptr<ceph_mount_info> mount,
+                                  const std::shared_ptr<InodeRefs>& refs,
+                                  Inode* inode, const vinodeno_t& vino);
+std::shared_ptr<Inode> ScopeInode(std::shared_ptr<ceph_mount_info> mount,
+                                  const std::shared_ptr<InodeRefs>& refs,
+                                  Inode* inode, const struct ceph_statx& sb);
+std::shared_ptr<Inode> ScopeInode(std::shared_ptr<ceph_mount_info> mount,
+                                  Inode* inode, const vinodeno_t& vino);
+std::shared_ptr<Inode> ScopeInode(std::shared_ptr<ceph_mount_info> mount,
+                                  Inode* inode, const struct ceph_statx& sb);
+
+// Most distinct inodes pinned on `mount` before work is deferred; 0 for no
+// limit. Mount() sets TESTSNAPSHOT_INODE_BUDGET when given, otherwise half
+// of client_cache_size.
+void SetInodeBudget(ceph_mount_info* mount, size_t budget);
+
+// Block while `mount` is over its budget, for at most `max_wait` so that a
+// holder waiting on the caller cannot deadlock it. Returns false if the
+// wait timed out. Call before work that pins more inodes.
+bool WaitForInodeBudget(
+    InodeRefs& refs,
+    std::chrono::milliseconds max_wait = std::chrono::seconds(1));
+bool WaitForInodeBudget(
+    ceph_mount_info* mount,
+    std::chrono::milliseconds max_wait = std::chrono::seconds(1));
+
+struct InodeRefStats {
+  size_t inodes = 0;       // Distinct {ino, snapid} pinned
+  size_t references = 0;   // Live references to them
+  size_t peak_inodes = 0;
+  uint64_t deferrals = 0;  // Waits in WaitForInodeBudget()
+  size_t budget = 0;
+};
+
+InodeRefStats GetInodeRefStats(ceph_mount_info* mount);
+
+// Log the counts for `mount`, labelled `name` if given, next to its
+// client_cache_size setting.
+void LogInodeRefs(std::shared_ptr<ceph_mount_info> mount,
+                  const std::string& name = "");
+
+// Forget `mount`, once it is being unmounted.
+void DropInodeRefs(ceph_mount_info* mount);
+
+#endif  // TESTSNAPSHOT_INODE_REFS_H_
@@ -0,0 +1,386 @@
+#include "log.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int64_t SteadyNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t WallNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+LogLevel LevelFromEnv() {
+  const char* env = std::getenv("TESTSNAPSHOT_LOG_LEVEL");
+  if (not env) {
+    return LogLevel::kInfo;
+  }
+
+  const std::string_view value(env);
+  if (value == "debug") {
+    return LogLevel::kDebug;
+  } else if (value == "warn") {
+    return LogLevel::kWarn;
+  } else if (value == "error") {
+    return LogLevel::kError;
+  }
+  return LogLevel::kInfo;
+}
+
+std::atomic<LogLevel>& Level() {
+  static std::atomic<LogLevel> level{LevelFromEnv()};
+  return level;
+}
+
+struct Record {
+  int64_t time_ns;
+  uint32_t thread;
+  LogLevel level;
+  uint16_t length;
+  char text[LogLine::kMaxLength];
+};
+
+// Single-producer single-consumer ring owned by one logging thread and
+// drained by the logger thread.
+class Ring {
+ public:
+  static constexpr uint64_t kSlots = 512;
+
+  explicit Ring(uint32_t thread) : thread_(thread) {}
+
+  // Producer side: a ring that is not full stays so until the next push.
+  bool Full() const {
+    return head_.load(std::memory_order_relaxed) -
+               tail_.load(std::memory_order_acquire) >=
+           kSlots;
+  }
+
+  bool TryPush(LogLevel level, const char* text, size_t length) {
+    if (Full()) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    Record& record = slots_[head % kSlots];
+    record.time_ns = WallNanos();
+    record.thread = thread_;
+    record.level = level;
+    record.length = static_cast<uint16_t>(length);
+    std::memcpy(record.text, text, length);
+
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side: records in [tail, head) are stable until Release().
+  uint64_t Head() const { return head_.load(std::memory_order_acquire); }
+  uint64_t Tail() const { return tail_.load(std::memory_order_relaxed); }
+  const Record& At(uint64_t index) const { return slots_[index % kSlots]; }
+  void Release(uint64_t tail) { tail_.store(tail, std::memory_order_release); }
+
+  uint64_t TakeDropped() {
+    return dropped_.exchange(0, std::memory_order_relaxed);
+  }
+
+ private:
+  const uint32_t thread_;
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  alignas(64) std::atomic<uint64_t> dropped_{0};
+  Record slots_[kSlots];
+};
+
+class Logger {
+ public:
+  static Logger& Get() {
+    static Logger logger;
+    return logger;
+  }
+
+  void Push(LogLevel level, const char* text, size_t length) {
+    ThreadRing().TryPush(level, text, length);
+  }
+
+  // Like Push(), but waits for drains while the ring is full. Only drops
+  // the line once the logger is stopping.
+  void PushWaiting(LogLevel level, const char* text, size_t length) {
+    Ring& ring = ThreadRing();
+    while (ring.Full()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stop_) {
+        break;
+      }
+      const uint64_t target = generation_ + 1;
+      flush_requested_ = true;
+      wake_.notify_one();
+      drained_.wait(lock, [&] { return generation_ >= target or stop_; });
+    }
+    ring.TryPush(level, text, length);
+  }
+
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const uint64_t target = generation_ + 2;
+    flush_requested_ = true;
+    wake_.notify_one();
+    drained_.wait(lock, [&] { return generation_ >= target or stop_; });
+  }
+
+  ~Logger() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+  }
+
+ private:
+  Logger() : thread_([this] { Run(); }) {}
+
+  Ring& ThreadRing() {
+    thread_local std::shared_ptr<Ring> ring;
+    if (not ring) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ring = std::make_shared<Ring>(next_thread_++);
+      rings_.push_back(ring);
+    }
+    return *ring;
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (not stop_) {
+      wake_.wait_for(lock, std::chrono::milliseconds(5),
+                     [&] { return stop_ or flush_requested_; });
+      flush_requested_ = false;
+
+      std::vector<std::shared_ptr<Ring>> rings = rings_;
+      lock.unlock();
+      Drain(rings);
+      rings.clear();
+      lock.lock();
+
+      // Forget rings whose thread has exited once they are empty
+      rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                  [](const std::shared_ptr<Ring>& ring) {
+                                    return ring.use_count() == 1 and
+                                           ring->Head() == ring->Tail();
+                                  }),
+                   rings_.end());
+
+      ++generation_;
+      drained_.notify_all();
+    }
+
+    std::vector<std::shared_ptr<Ring>> rings = rings_;
+    lock.unlock();
+    Drain(rings);
+  }
+
+  void Drain(const std::vector<std::shared_ptr<Ring>>& rings) {
+    struct Pending {
+      Ring* ring;
+      uint64_t head;
+    };
+    std::vector<Pending> pending;
+    std::vector<const Record*> records;
+    uint64_t dropped = 0;
+
+    for (const auto& ring : rings) {
+      const uint64_t head = ring->Head();
+      for (uint64_t i = ring->Tail(); i != head; ++i) {
+        records.push_back(&ring->At(i));
+      }
+      pending.push_back({ring.get(), head});
+      dropped += ring->TakeDropped();
+    }
+
+    std::stable_sort(records.begin(), records.end(),
+                     [](const Record* a, const Record* b) {
+                       return a->time_ns < b->time_ns;
+                     });
+
+    out_.clear();
+    err_.clear();
+    for (const Record* record : records) {
+      Format(*record, record->level >= LogLevel::kWarn ? err_ : out_);
+    }
+
+    for (const auto& p : pending) {
+      p.ring->Release(p.head);
+    }
+
+    if (dropped) {
+      err_ += "log: dropped " + std::to_string(dropped) +
+              " lines, ring buffers full\n";
+    }
+
+    WriteAll(STDOUT_FILENO, out_);
+    WriteAll(STDERR_FILENO, err_);
+  }
+
+  void Format(const Record& record, std::string& out) {
+    const time_t seconds = record.time_ns / 1000000000;
+    if (seconds != cached_second_) {
+      struct tm tm;
+      gmtime_r(&seconds, &tm);
+      std::strftime(cached_stamp_, sizeof(cached_stamp_), "%Y-%m-%dT%H:%M:%S",
+                    &tm);
+      cached_second_ = seconds;
+    }
+
+    static constexpr char kLevels[] = {'D', 'I', 'W', 'E'};
+    char prefix[64];
+    const int n = std::snprintf(
+        prefix, sizeof(prefix), "%s.%06lldZ %c [%u] ", cached_stamp_,
+        static_cast<long long>((record.time_ns % 1000000000) / 1000),
+        kLevels[static_cast<int>(record.level)], record.thread);
+
+    out.append(prefix, n);
+    out.append(record.text, record.length);
+    out.push_back('\n');
+  }
+
+  static void WriteAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+      const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      written += n;
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable drained_;
+  std::vector<std::shared_ptr<Ring>> rings_;
+  uint32_t next_thread_ = 0;
+  uint64_t generation_ = 0;
+  bool flush_requested_ = false;
+  bool stop_ = false;
+
+  // Only touched by the logger thread
+  std::string out_;
+  std::string err_;
+  time_t cached_second_ = -1;
+  char cached_stamp_[32] = {};
+
+  std::thread thread_;
+};
+
+}  // namespace
+
+void SetLogLevel(LogLevel level) {
+  Level().store(level, std::memory_order_relaxed);
+}
+
+LogLevel GetLogLevel() { return Level().load(std::memory_order_relaxed); }
+
+void FlushLog() { Logger::Get().Flush(); }
+
+bool LogRateLimit::Allow(uint64_t* suppressed) {
+  const int64_t now = SteadyNanos();
+  int64_t start = window_start_.load(std::memory_order_relaxed);
+  if (now - start >= period_ns_ and
+      window_start_.compare_exchange_strong(start, now,
+                                            std::memory_order_relaxed)) {
+    count_.store(0, std::memory_order_relaxed);
+  }
+
+  if (count_.fetch_add(1, std::memory_order_relaxed) < burst_) {
+    *suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  suppressed_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+bool LogShouldEmit(LogLevel level, LogRateLimit& limit, uint64_t* suppressed) {
+  if (not LogEnabled(level)) {
+    return false;
+  }
+  if (level < LogLevel::kWarn) {
+    return true;
+  }
+  return limit.Allow(suppressed);
+}
+
+LogLine::LogLine(LogLevel level, uint64_t suppressed) : level_(level) {
+  if (suppressed) {
+    *this << "[" << suppressed << " similar lines suppressed] ";
+  }
+}
+
+LogLine::LogLine(LogLevel level, LogWaitWhenFull)
+    : level_(level), wait_when_full_(true) {}
+
+LogLine::~LogLine() {
+  if (truncated_ and length_ >= 3) {
+    std::memcpy(text_ + length_ - 3, "...", 3);
+  }
+  if (wait_when_full_) {
+    Logger::Get().PushWaiting(level_, text_, length_);
+  } else {
+    Logger::Get().Push(level_, text_, length_);
+  }
+}
+
+void LogLine::Append(const char* data, size_t size) {
+  const size_t room = kMaxLength - length_;
+  if (size > room) {
+    size = room;
+    truncated_ = true;
+  }
+  std::memcpy(text_ + length_, data, size);
+  length_ += size;
+}
+
+void LogLine::AppendSigned(int64_t value) {
+  char buf[24];
+  const auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  Append(buf, end - buf);
+}
+
+void LogLine::AppendUnsigned(uint64_t value) {
+  char buf[24];
+  const auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  Append(buf, end - buf);
+}
+
+LogLine& LogLine::operator<<(double value) {
+  char buf[32];
+  const int n = std::snprintf(buf, sizeof(buf), "%g", value);
+  Append(buf, n);
+  return *this;
+}
+
+LogLine& LogLine::operator<<(const std::filesystem::path& value) {
+  return *this << '"' << value.native() << '"';
+}
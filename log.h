@@ -0,0 +1,144 @@
+#ifndef TESTSNAPSHOT_LOG_H_
+#define TESTSNAPSHOT_LOG_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Asynchronous logger.
+//
+// A log line is formatted on the caller's stack and pushed into a
+// per-thread single-producer ring buffer; a background thread drains all
+// rings and writes them out in batches. Callers never take a lock or make
+// a syscall. When a ring is full the line is dropped and counted rather
+// than blocking the caller; only LOG_UNLIMITED() lines wait for room.
+//
+// Usage:
+//   LOG(kError) << "Failed to open directory: error " << -result << " ("
+//               << ::strerror(-result) << ")";
+//
+// kWarn and kError lines are rate limited per call site; lines over the
+// limit are counted and the count is reported on the next emitted line.
+// LOG_UNLIMITED() skips the limit.
+
+enum class LogLevel : uint8_t { kDebug, kInfo, kWarn, kError };
+
+// Lines below this level are discarded before formatting. Defaults to
+// kInfo, or to TESTSNAPSHOT_LOG_LEVEL (debug|info|warn|error) when set.
+void SetLogLevel(LogLevel level);
+LogLevel GetLogLevel();
+
+inline bool LogEnabled(LogLevel level) { return level >= GetLogLevel(); }
+
+// Block until every line logged before the call has been written.
+void FlushLog();
+
+// Per call site token bucket: at most `burst` lines per `period`.
+class LogRateLimit {
+ public:
+  explicit LogRateLimit(uint32_t burst = 10,
+                        std::chrono::milliseconds period =
+                            std::chrono::milliseconds(1000))
+      : burst_(burst), period_ns_(period.count() * 1000000) {}
+
+  // Returns true if the line may be emitted. In that case `suppressed`
+  // receives the number of lines dropped since the last emitted one.
+  bool Allow(uint64_t* suppressed);
+
+ private:
+  const uint32_t burst_;
+  const int64_t period_ns_;
+  std::atomic<int64_t> window_start_{0};
+  std::atomic<uint32_t> count_{0};
+  std::atomic<uint64_t> suppressed_{0};
+};
+
+bool LogShouldEmit(LogLevel level, LogRateLimit& limit, uint64_t* suppressed);
+
+// Makes a LogLine wait for the logger to drain a full ring rather than
+// drop the line.
+struct LogWaitWhenFull {};
+
+// One log line. Formats into a fixed buffer and commits on destruction.
+class LogLine {
+ public:
+  static constexpr size_t kMaxLength = 496;
+
+  explicit LogLine(LogLevel level, uint64_t suppressed = 0);
+  LogLine(LogLevel level, LogWaitWhenFull);
+  ~LogLine();
+
+  LogLine(const LogLine&) = delete;
+  LogLine& operator=(const LogLine&) = delete;
+
+  LogLine& operator<<(std::string_view value) {
+    Append(value.data(), value.size());
+    return *this;
+  }
+  LogLine& operator<<(const char* value) {
+    return *this << std::string_view(value ? value : "(null)");
+  }
+  LogLine& operator<<(const std::string& value) {
+    return *this << std::string_view(value);
+  }
+  LogLine& operator<<(char value) {
+    Append(&value, 1);
+    return *this;
+  }
+  LogLine& operator<<(bool value) { return *this << (value ? "1" : "0"); }
+  LogLine& operator<<(double value);
+  // Paths are quoted, as std::ostream does.
+  LogLine& operator<<(const std::filesystem::path& value);
+
+  template <typename T,
+            typename std::enable_if_t<std::is_integral_v<T> and
+                                          not std::is_same_v<T, bool> and
+                                          not std::is_same_v<T, char>,
+                                      int> = 0>
+  LogLine& operator<<(T value) {
+    if constexpr (std::is_signed_v<T>) {
+      AppendSigned(static_cast<int64_t>(value));
+    } else {
+      AppendUnsigned(static_cast<uint64_t>(value));
+    }
+    return *this;
+  }
+
+ private:
+  void Append(const char* data, size_t size);
+  void AppendSigned(int64_t value);
+  void AppendUnsigned(uint64_t value);
+
+  const LogLevel level_;
+  const bool wait_when_full_ = false;
+  size_t length_ = 0;
+  bool truncated_ = false;
+  char text_[kMaxLength];
+};
+
+#define LOG_SITE_LIMIT()                 \
+  ([]() -> LogRateLimit& {               \
+    static LogRateLimit log_site_limit_; \
+    return log_site_limit_;              \
+  }())
+
+#define LOG(severity)                                                    \
+  if (uint64_t log_suppressed_ = 0; not LogShouldEmit(                   \
+          LogLevel::severity, LOG_SITE_LIMIT(), &log_suppressed_)) {     \
+  } else                                                                 \
+    LogLine(LogLevel::severity, log_suppressed_)
+
+// LOG() that never loses the line, for lines that must all be seen, such
+// as verification findings: no per call site rate limit, and a full ring
+// blocks the caller until the logger has drained it.
+#define LOG_UNLIMITED(severity)                       \
+  if (not LogEnabled(LogLevel::severity)) {           \
+  } else                                              \
+    LogLine(LogLevel::severity, LogWaitWhenFull())
+
+#endif  // TESTSNAPSHOT_LOG_H_
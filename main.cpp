@@ -3,14 +3,27 @@
 #include <stdio.h>
 #include <sys/stat.h>
 
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <functional>
-#include <iostream>
 #include <memory>
 #include <queue>
 #include <string>
+#include <vector>
+
+#include "archive.h"
+#include "client.h"
+#include "history.h"
+#include "inode_refs.h"
+#include "log.h"
+#include "scheduler.h"
+#include "small_file_reader.h"
+#include "sparse.h"
+#include "verify.h"
+#include "walker.h"
 
 const std::string volume{"cephfs"};
 const std::string sub_volume{"1"};
@@ -26,185 +39,6 @@ const std::string xattr_name{"user.test-snapshot-xattr"};
 const std::string xattr_value{"test-snapshot-xattr-value"};
 const std::string snap_name{"test-snapshot"};
 
-const std::filesystem::path config{"/etc/ceph/ceph.conf"};
-const std::string client_id{"admin"};
-const std::string client_uuid{"lx-2024-07-10"};
-
-int Mount(std::shared_ptr<ceph_mount_info>& mount,
-          std::shared_ptr<UserPerm>& user_perms) {
-  namespace fs = std::filesystem;
-
-  if (not fs::exists(config) or not fs::is_regular_file(config)) {
-    std::cerr << "Unable to use " << config
-              << " as a configuration file for ceph" << std::endl;
-    return -EINVAL;
-  }
-
-  int result;
-
-  {  // Create the mount point
-    ceph_mount_info* cmount;
-    result = ceph_create(&cmount, client_id.c_str());
-    if (result) {
-      std::cerr << "Failed to create ceph mount: error " << -result << " ("
-                << ::strerror(-result) << ")" << std::endl;
-      return result;
-    }
-
-    mount =
-        std::shared_ptr<ceph_mount_info>(cmount, [](ceph_mount_info* cmount) {
-          if (cmount) {
-            int result = ceph_unmount(cmount);
-            if (result) {
-              std::cerr << "Failed to unmount ceph mount: error " << -result
-                        << " (" << ::strerror(-result) << ")" << std::endl;
-            }
-
-            result = ceph_release(cmount);
-            if (result) {
-              std::cerr << "Failed to release ceph mount: error " << -result
-                        << " (" << ::strerror(-result) << ")" << std::endl;
-            }
-          }
-        });
-  }
-
-  // Read the configuration file
-  result = ceph_conf_read_file(mount.get(), config.c_str());
-  if (result) {
-    std::cerr << "Failed read configuration file " << config << ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
-    return result;
-  }
-
-  // Process any environment variables
-  result = ceph_conf_parse_env(mount.get(), nullptr);
-  if (result) {
-    std::cerr << "Failed parse ceph environment variables: error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
-    return result;
-  }
-
-  result = ceph_conf_set(mount.get(), "debug_client", "1");
-  if (result) {
-    std::cerr << "Failed to set mount option debug_client value 1: error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
-    return result;
-  }
-
-  // Initialize the mount point
-  result = ceph_init(mount.get());
-  if (result) {
-    std::cerr << "Failed to initialize ceph mount point: error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
-    return result;
-  }
-
-  std::cout << "Mounting ceph node" << std::endl;
-
-  ceph_set_session_timeout(mount.get(), 60);
-
-  result =
-      ceph_start_reclaim(mount.get(), client_uuid.c_str(), CEPH_RECLAIM_RESET);
-  if (result == -ENOTRECOVERABLE) {
-    std::cerr << "Failed to start ceph reclaim" << std::endl;
-    return result;
-  } else if (result == -ENOENT) {
-    std::cerr << "Not an error - Failed to start ceph reclaim" << std::endl;
-  } else {
-    std::cout << "Succeed on starting ceph reclaim" << std::endl;
-  }
-
-  ceph_finish_reclaim(mount.get());
-
-  ceph_set_uuid(mount.get(), client_uuid.c_str());
-
-  result = ceph_mount(mount.get(), nullptr);
-  if (result) {
-    std::cerr << "Failed to mount ceph: error " << -result << " ("
-              << ::strerror(-result) << ")" << std::endl;
-    return result;
-  }
-
-  {  // Get the user permissions
-    UserPerm* perms = ceph_mount_perms(mount.get());
-    if (not perms) {
-      result = -EIO;
-      std::cerr << "Failed get user perms: error " << -result << " ("
-                << ::strerror(-result) << ")" << std::endl;
-      return result;
-    }
-
-    user_perms = std::shared_ptr<UserPerm>(perms, [](UserPerm*) {});
-  }
-
-  return result;
-}
-
-using DirEntryCallback =
-    std::function<bool(const std::string& name, const struct ceph_statx& sb,
-                       std::shared_ptr<Inode>)>;
-
-int ReadDir(std::shared_ptr<ceph_mount_info> mount,
-            std::shared_ptr<Inode> parent, DirEntryCallback callback) {
-  struct ceph_dir_result* dh_parent = nullptr;
-
-  int result = ceph_ll_opendir(mount.get(), parent.get(), &dh_parent,
-                               ceph_mount_perms(mount.get()));
-  if (result) {
-    std::cerr << "Failed to open directory: error " << -result << " ("
-              << ::strerror(-result) << ")" << std::endl;
-    return result;
-  }
-
-  std::shared_ptr<ceph_dir_result> scoped_dh_parent(
-      dh_parent,
-      [mount](ceph_dir_result* dh) { ceph_ll_releasedir(mount.get(), dh); });
-
-  bool done = false;
-
-  do {
-    dirent entry;
-    struct ceph_statx sb;
-    struct Inode* ceph_inode;
-
-    result = ceph_readdirplus_r(mount.get(), dh_parent, &entry, &sb,
-                                CEPH_STATX_ALL_STATS, 0, &ceph_inode);
-    if (result < 0) {
-      std::cerr << "Failed to read directory: error " << -result << " ("
-                << ::strerror(-result) << ")" << std::endl;
-      break;
-    }
-
-    if (result == 0) {
-      break;
-    }
-
-    auto eh = std::shared_ptr<Inode>(ceph_inode, [mount](struct Inode* inode) {
-      ceph_ll_put(mount.get(), inode);
-    });
-
-    const std::string entry_name(entry.d_name);
-
-    done = not callback(entry_name, sb, eh);
-  } while (not done);
-
-  return result;
-}
-
-typedef struct inodeno_t {
-  uint64_t val;
-} inodeno_t;
-
-typedef struct snapid_t {
-  uint64_t val;
-} snapid_t;
-
-typedef struct vinodeno_t {
-  inodeno_t ino;
-  snapid_t snapid;
-} vinodeno_t;
-
 int prepare(std::shared_ptr<ceph_mount_info> mount, struct ceph_statx& dir_sb, 
             struct ceph_statx& sub_dir_sb, struct ceph_statx& file_sb) {
   struct ceph_statx sb_fs;
@@ -214,13 +48,13 @@ int prepare(std::shared_ptr<ceph_mount_info> mount, struct ceph_statx& dir_sb,
       ceph_ll_walk(mount.get(), fs_path.c_str(), &inode_fs, &sb_fs,
                    CEPH_STATX_ALL_STATS, 0, ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to walk ceph path " << fs_path << ": error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to walk ceph path " << fs_path << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_parent_inode(
-      inode_fs, [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_parent_inode =
+      ScopeInode(mount, inode_fs, sb_fs);
 
   Inode* test_dir_inode = nullptr;
 
@@ -228,30 +62,28 @@ int prepare(std::shared_ptr<ceph_mount_info> mount, struct ceph_statx& dir_sb,
                          &test_dir_inode, &dir_sb, CEPH_STATX_ALL_STATS, 0,
                          ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to create directory " << dir_name << ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to create directory " << dir_name << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_test_dir_inode(
-      test_dir_inode,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_test_dir_inode =
+      ScopeInode(mount, test_dir_inode, dir_sb);
 
   result = ceph_ll_setxattr(mount.get(), test_dir_inode, xattr_name.c_str(),
                             xattr_value.c_str(), xattr_value.size(), 0,
                             ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to set xattr " << xattr_name << ": error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to set xattr " << xattr_name << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   result = ceph_ll_getxattr(mount.get(), test_dir_inode, xattr_name.c_str(),
                             nullptr, 0, ceph_mount_perms(mount.get()));
   if (result < 0) {
-    std::cerr << "Failed to get length of active dir's xattr " << xattr_name
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to get length of active dir's xattr " << xattr_name
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -261,30 +93,28 @@ int prepare(std::shared_ptr<ceph_mount_info> mount, struct ceph_statx& dir_sb,
                          &test_sub_dir_inode, &sub_dir_sb, CEPH_STATX_ALL_STATS, 0,
                          ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to create sub directory " << sub_dir_name << ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to create sub directory " << sub_dir_name << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_test_sub_dir_inode(
-      test_sub_dir_inode,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_test_sub_dir_inode =
+      ScopeInode(mount, test_sub_dir_inode, sub_dir_sb);
 
   result = ceph_ll_setxattr(mount.get(), test_sub_dir_inode, xattr_name.c_str(),
                             xattr_value.c_str(), xattr_value.size(), 0,
                             ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to set sub-dir's xattr " << xattr_name << ": error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to set sub-dir's xattr " << xattr_name << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   result = ceph_ll_getxattr(mount.get(), test_sub_dir_inode, xattr_name.c_str(),
                             nullptr, 0, ceph_mount_perms(mount.get()));
   if (result < 0) {
-    std::cerr << "Failed to get length of active sub-dir's xattr " << xattr_name
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to get length of active sub-dir's xattr " << xattr_name
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -296,55 +126,54 @@ int prepare(std::shared_ptr<ceph_mount_info> mount, struct ceph_statx& dir_sb,
                           &file_sb, CEPH_STATX_ALL_STATS, 0,
                           ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to create file " << file_name << ": error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to create file " << file_name << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   result = ceph_ll_write(mount.get(), fhp_test_file, 0, 9, "some data");
   if (result < 0) {
-    std::cerr << "Failed to write to file"
-                 ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to write to file"
+                   ": error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   result = ceph_ll_close(mount.get(), fhp_test_file);
   if (result) {
-    std::cerr << "Failed to close file " << file_name << ": error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to close file " << file_name << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
   }
 
-  std::shared_ptr<Inode> scoped_test_file_inode(
-      test_file_inode,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_test_file_inode =
+      ScopeInode(mount, test_file_inode, file_sb);
 
   result = ceph_ll_setxattr(mount.get(), test_file_inode, xattr_name.c_str(),
                             xattr_value.c_str(), xattr_value.size(), 0,
                             ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to set xattr " << xattr_name << ": error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to set xattr " << xattr_name << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   result = ceph_ll_getxattr(mount.get(), test_file_inode, xattr_name.c_str(),
                             nullptr, 0, ceph_mount_perms(mount.get()));
   if (result < 0) {
-    std::cerr << "Failed to get length of active dir's xattr " << xattr_name
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to get length of active dir's xattr " << xattr_name
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
 #if 1
   std::string create_snap_cmd = "ceph fs subvolume snapshot create " + volume +
                                 " " + sub_volume + " " + snap_name;
-  std::cout << create_snap_cmd << std::endl;
+  LOG(kInfo) << create_snap_cmd;
+  FlushLog();
   result = system(create_snap_cmd.c_str());
   if (result) {
-    std::cerr << "Failed to create snapshot " << snap_name << ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to create snapshot " << snap_name << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -352,8 +181,8 @@ int prepare(std::shared_ptr<ceph_mount_info> mount, struct ceph_statx& dir_sb,
   result = ceph_mksnap(mount.get(), fs_path.c_str(), snap_name.c_str(), 0755,
                        nullptr, 0);
   if (result) {
-    std::cerr << "Failed to create snapshot " << snap_name << ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to create snapshot " << snap_name << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -364,46 +193,584 @@ int prepare(std::shared_ptr<ceph_mount_info> mount, struct ceph_statx& dir_sb,
   result = ceph_ll_rmdir(mount.get(), test_dir_inode, sub_dir_name.c_str(),
                          ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to rmdir"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to rmdir"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   result = ceph_ll_rmdir(mount.get(), inode_fs, dir_name.c_str(),
                          ceph_mount_perms(mount.get()));
   if (result) {
-    std::cerr << "Failed to rmdir"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to rmdir"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   // result = ceph_ll_unlink(mount.get(), inode_fs, file_name.c_str(),
   // ceph_mount_perms(mount.get())); if (result) {
-  //   std::cerr << "Failed to unlink file" ": error " << -result << " (" <<
-  //   ::strerror(-result) << ")" << std::endl; return result;
+  //   LOG(kError) << "Failed to unlink file" ": error " << -result << " (" <<
+  //   ::strerror(-result) << ")"; return result;
   // }
 
   // result = ceph_ll_setxattr(mount.get(), test_file_inode, xattr_name.c_str(),
   // xattr_value.c_str(), xattr_value.size(), 0, ceph_mount_perms(mount.get()));
   // if (result) {
-  //     std::cerr << "Failed to set xattr " << xattr_name << ": error " <<
-  //     -result << " (" << ::strerror(-result) << ")" << std::endl; return
+  //     LOG(kError) << "Failed to set xattr " << xattr_name << ": error " <<
+  //     -result << " (" << ::strerror(-result) << ")"; return
   //     result;
   // }
 
   return result;
 }
 
-int main(int, char**) {
+// Copy the file at `src_path`, typically inside a .snap directory, to a new
+// file at `dst_path` without transferring or writing its holes.
+int CopyFile(std::shared_ptr<ceph_mount_info> mount, const std::string& src_path,
+             const std::string& dst_path,
+             const StripedWriterOptions& write_options) {
+  std::shared_ptr<Inode> scoped_src;
+  struct ceph_statx src_sb;
+
+  int result = WalkPath(mount, src_path, scoped_src, src_sb);
+  if (result) {
+    return result;
+  }
+
+  const std::filesystem::path dst(dst_path);
+  std::shared_ptr<Inode> scoped_dst_dir;
+  struct ceph_statx dst_dir_sb;
+
+  result = WalkPath(mount,
+                    dst.has_parent_path() ? dst.parent_path().string() : "/",
+                    scoped_dst_dir, dst_dir_sb);
+  if (result) {
+    return result;
+  }
+
+  Fh* fh_src = nullptr;
+  result = ceph_ll_open(mount.get(), scoped_src.get(), O_RDONLY, &fh_src,
+                        ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    LOG(kError) << "Failed to open " << src_path << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<Fh> scoped_fh_src(
+      fh_src, [mount](Fh* fh) { ceph_ll_close(mount.get(), fh); });
+
+  Fh* fh_dst = nullptr;
+  Inode* dst_inode = nullptr;
+  struct ceph_statx dst_sb;
+
+  result = ceph_ll_create(mount.get(), scoped_dst_dir.get(),
+                          dst.filename().c_str(), src_sb.stx_mode & 07777,
+                          O_CREAT | O_EXCL | O_WRONLY, &dst_inode, &fh_dst,
+                          &dst_sb, CEPH_STATX_ALL_STATS, 0,
+                          ceph_mount_perms(mount.get()));
+  if (result) {
+    LOG(kError) << "Failed to create file " << dst_path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<Inode> scoped_dst = ScopeInode(mount, dst_inode, dst_sb);
+  std::shared_ptr<Fh> scoped_fh_dst(
+      fh_dst, [mount](Fh* fh) { ceph_ll_close(mount.get(), fh); });
+
+  SparseStats stats;
+  WriteStats write_stats;
+  result = CopySparse(mount, fh_src, src_sb.stx_size, fh_dst, dst_inode,
+                      &stats, write_options, &write_stats);
+  if (result) {
+    return result;
+  }
+
+  LOG(kInfo) << "Copied " << src_path << " to " << dst_path << ": "
+             << src_sb.stx_size << " bytes, " << stats.data_bytes
+             << " written, " << src_sb.stx_size - stats.data_bytes
+             << " left as holes";
+  LogWriteStats(dst_path, write_stats);
+  return 0;
+}
+
+// Reads the content of every regular file a walk finds: small files are
+// batched through a SmallFileReader, larger ones go through ReadSparse() on
+// the walker thread.
+class TreeReader {
+ public:
+  TreeReader(std::shared_ptr<ceph_mount_info> mount,
+             const SmallFileOptions& options)
+      : mount_(mount),
+        small_files_(mount, options, [this](FileBatch& batch) {
+          ++batches_;
+          for (const auto& file : batch.files) {
+            Count(file.result, file.size, small_);
+          }
+          return 0;
+        }) {}
+
+  int Read(const std::string& path, const struct ceph_statx& sb,
+           std::shared_ptr<Inode> inode) {
+    if (not S_ISREG(sb.stx_mode)) {
+      return 0;
+    }
+
+    if (sb.stx_size <= small_files_.options().max_file_size) {
+      return small_files_.Add(path, sb, inode);
+    }
+
+    Fh* fh = nullptr;
+    int result = ceph_ll_open(mount_.get(), inode.get(), O_RDONLY, &fh,
+                              ceph_mount_perms(mount_.get()));
+    if (result < 0) {
+      LOG(kError) << "Failed to open " << path << ": error " << -result
+                  << " (" << ::strerror(-result) << ")";
+      Count(result, 0, large_);
+      return 0;
+    }
+
+    std::shared_ptr<Fh> scoped_fh(
+        fh, [this](Fh* fh) { ceph_ll_close(mount_.get(), fh); });
+
+    SparseStats stats;
+    result = ReadSparse(
+        mount_, fh, sb.stx_size,
+        [](uint64_t, const char*, size_t) { return 0; }, &stats);
+    Count(result, stats.read_bytes, large_);
+    return 0;
+  }
+
+  // Returns -EIO if any file could not be read.
+  int Finish() {
+    int result = small_files_.Finish();
+    return result ? result : failed_ ? -EIO : 0;
+  }
+
+  void Report(std::chrono::steady_clock::duration elapsed) const {
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    const uint64_t files = small_.files + large_.files;
+    const uint64_t bytes = small_.bytes + large_.bytes;
+
+    LOG(kInfo) << "Read " << files << " files, " << bytes << " bytes in "
+               << seconds << "s: " << files / seconds << " files/s, "
+               << bytes / seconds / (1 << 20) << " MiB/s";
+    LOG(kInfo) << "  " << small_.files.load() << " small files, "
+               << small_.bytes.load() << " bytes in " << batches_.load()
+               << " batches; " << large_.files.load() << " large files, "
+               << large_.bytes.load() << " bytes; " << failed_.load()
+               << " failed";
+  }
+
+ private:
+  struct Totals {
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> bytes{0};
+  };
+
+  void Count(int result, uint64_t bytes, Totals& totals) {
+    if (result) {
+      ++failed_;
+      return;
+    }
+    ++totals.files;
+    totals.bytes += bytes;
+  }
+
+  const std::shared_ptr<ceph_mount_info> mount_;
+  Totals small_;
+  Totals large_;
+  std::atomic<uint64_t> batches_{0};
+  std::atomic<uint64_t> failed_{0};
+  SmallFileReader small_files_;  // Last, as its callback uses the above
+};
+
+struct Command {
+  std::function<int(std::shared_ptr<ceph_mount_info>)> run;
+  // Commands that mount for themselves run with a null mount
+  bool mount = true;
+};
+
+void Usage() {
+  LOG(kError) << "usage: testsnapshot";
+  LOG(kError) << "       testsnapshot history <path> [--digest] [--threads N]";
+  LOG(kError) << "       testsnapshot walk <path> [--checkpoint FILE]"
+                 " [--threads N] [--frontier-memory BYTES] [--spill-dir DIR]"
+                 " [--read] [--in-flight N]";
+  LOG(kError) << "       testsnapshot copy <src-path> <dst-path>"
+                 " [--in-flight N] [--fsync none|finish|BYTES]";
+  LOG(kError) << "       testsnapshot archive <path> <archive-file>"
+                 " [--threads N] [--level N] [--walk-threads N]";
+  LOG(kError) << "       testsnapshot extract <archive-file> <path>"
+                 " <local-path>";
+  LOG(kError) << "       testsnapshot verify <snapshot-path> <live-path>"
+                 " [--threads N] [--walk-threads N] [--checkpoint FILE]"
+                 " [--no-digest]";
+  LOG(kError) << "       testsnapshot schedule <job-file> [--jobs N]"
+                 " [--jobs-per-volume N] [--mounts-per-volume N]"
+                 " [--walk-threads N] [--budget SECONDS]"
+                 " [--checkpoint-dir DIR]";
+}
+
+bool ParseCount(const std::string& value, size_t& count) {
+  char* end = nullptr;
+  const unsigned long long parsed = std::strtoull(value.c_str(), &end, 10);
+  if (value.empty() or *end != '\0' or parsed == 0) {
+    return false;
+  }
+  count = parsed;
+  return true;
+}
+
+int ParseCommand(const std::vector<std::string>& args, Command& command) {
+  if (args[0] == "history" and args.size() >= 2) {
+    const std::string path = args[1];
+    HistoryOptions options;
+
+    for (size_t i = 2; i < args.size(); ++i) {
+      if (args[i] == "--digest") {
+        options.digest = true;
+      } else if (args[i] == "--threads" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.threads)) {
+        ++i;
+      } else {
+        return -EINVAL;
+      }
+    }
+
+    command.run = [path, options](std::shared_ptr<ceph_mount_info> mount) {
+      std::vector<VersionGroup> history;
+      int result = ReadHistory(mount, path, options, history);
+      if (result) {
+        return result;
+      }
+      PrintHistory(path, history);
+      return 0;
+    };
+    return 0;
+  }
+
+  if (args[0] == "walk" and args.size() >= 2) {
+    const std::string path = args[1];
+    WalkOptions options;
+    SmallFileOptions read_options;
+    bool read = false;
+
+    for (size_t i = 2; i < args.size(); ++i) {
+      if (args[i] == "--read") {
+        read = true;
+      } else if (args[i] == "--in-flight" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], read_options.in_flight)) {
+        ++i;
+      } else if (args[i] == "--checkpoint" and i + 1 < args.size()) {
+        options.checkpoint_path = args[++i];
+      } else if (args[i] == "--frontier-memory" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.frontier_memory)) {
+        ++i;
+      } else if (args[i] == "--spill-dir" and i + 1 < args.size()) {
+        options.spill_dir = args[++i];
+      } else if (args[i] == "--threads" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.threads)) {
+        ++i;
+      } else {
+        return -EINVAL;
+      }
+    }
+
+    command.run = [path, options, read,
+                   read_options](std::shared_ptr<ceph_mount_info> mount) {
+      std::shared_ptr<Inode> scoped_root;
+      struct ceph_statx sb;
+
+      int result = WalkPath(mount, path, scoped_root, sb);
+      if (result) {
+        return result;
+      }
+
+      const vinodeno_t root = {{sb.stx_ino}, {sb.stx_dev}};
+      scoped_root.reset();
+
+      std::unique_ptr<TreeReader> tree_reader;
+      WalkCallback callback = [](const std::string&, const struct ceph_statx&,
+                                 std::shared_ptr<Inode>) { return true; };
+      if (read) {
+        tree_reader = std::make_unique<TreeReader>(mount, read_options);
+        callback = [&tree_reader](const std::string& path,
+                                  const struct ceph_statx& sb,
+                                  std::shared_ptr<Inode> inode) {
+          return tree_reader->Read(path, sb, inode) == 0;
+        };
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      WalkStats stats;
+      result = WalkTree(mount, root, options, callback, &stats);
+
+      LOG(kInfo) << "Walked " << stats.dirs << " directories and "
+                 << stats.entries << " entries below " << path
+                 << (stats.resumed ? " (resumed)" : "");
+      if (tree_reader) {
+        const int read_result = tree_reader->Finish();
+        if (result == 0) {
+          result = read_result;
+        }
+        tree_reader->Report(std::chrono::steady_clock::now() - start);
+      }
+      if (result) {
+        LOG(kError) << "Walk of " << path << " stopped: error " << -result
+                    << " (" << ::strerror(-result) << ")";
+      }
+      return result;
+    };
+    return 0;
+  }
+
+  if (args[0] == "copy" and args.size() >= 3) {
+    const std::string src_path = args[1];
+    const std::string dst_path = args[2];
+    StripedWriterOptions options;
+
+    for (size_t i = 3; i < args.size(); ++i) {
+      if (args[i] == "--in-flight" and i + 1 < args.size() and
+          ParseCount(args[i + 1], options.in_flight)) {
+        ++i;
+      } else if (args[i] == "--fsync" and i + 1 < args.size()) {
+        const std::string& policy = args[++i];
+        size_t bytes = 0;
+        if (policy == "none") {
+          options.fsync = FsyncPolicy::kNone;
+        } else if (policy == "finish") {
+          options.fsync = FsyncPolicy::kFinish;
+        } else if (ParseCount(policy, bytes)) {
+          options.fsync = FsyncPolicy::kInterval;
+          options.fsync_bytes = bytes;
+        } else {
+          return -EINVAL;
+        }
+      } else {
+        return -EINVAL;
+      }
+    }
+
+    command.run = [src_path, dst_path,
+                   options](std::shared_ptr<ceph_mount_info> mount) {
+      return CopyFile(mount, src_path, dst_path, options);
+    };
+    return 0;
+  }
+
+  if (args[0] == "archive" and args.size() >= 3) {
+    const std::string path = args[1];
+    const std::string archive = args[2];
+    ArchiveOptions options;
+    WalkOptions walk_options;
+    size_t level = options.level;
+
+    for (size_t i = 3; i < args.size(); ++i) {
+      if (args[i] == "--level" and i + 1 < args.size() and
+          ParseCount(args[i + 1], level)) {
+        options.level = level;
+        ++i;
+      } else if (args[i] == "--threads" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.threads)) {
+        ++i;
+      } else if (args[i] == "--walk-threads" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], walk_options.threads)) {
+        ++i;
+      } else {
+        return -EINVAL;
+      }
+    }
+
+    command.run = [path, archive, options,
+                   walk_options](std::shared_ptr<ceph_mount_info> mount) {
+      std::shared_ptr<Inode> scoped_root;
+      struct ceph_statx sb;
+
+      int result = WalkPath(mount, path, scoped_root, sb);
+      if (result) {
+        return result;
+      }
+
+      const vinodeno_t root = {{sb.stx_ino}, {sb.stx_dev}};
+      scoped_root.reset();
+
+      ArchiveWriter writer(mount, options);
+      result = writer.Open(archive);
+      if (result) {
+        return result;
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      std::atomic<int> error{0};
+
+      result = WalkTree(
+          mount, root, walk_options,
+          [&writer, &error](const std::string& path,
+                            const struct ceph_statx& sb,
+                            std::shared_ptr<Inode> inode) {
+            int result = writer.Add(path, sb, inode);
+            if (result) {
+              error = result;
+              return false;
+            }
+            return true;
+          });
+      if (error) {
+        result = error;
+      }
+
+      ArchiveStats stats;
+      const int finish_result = writer.Finish(&stats);
+      if (result == 0) {
+        result = finish_result;
+      }
+
+      const double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+      LOG(kInfo) << "Archived " << stats.files << " entries below " << path
+                 << " to " << archive << ": " << stats.data_bytes
+                 << " bytes in " << stats.frames << " frames, "
+                 << stats.compressed_bytes << " compressed, "
+                 << stats.data_bytes / seconds / (1 << 20) << " MiB/s";
+      return result;
+    };
+    return 0;
+  }
+
+  if (args[0] == "extract" and args.size() == 4) {
+    const std::string archive = args[1];
+    const std::string path = args[2];
+    const std::string destination = args[3];
+
+    command.mount = false;
+    command.run = [archive, path,
+                   destination](std::shared_ptr<ceph_mount_info>) {
+      return ExtractFile(archive, path, destination);
+    };
+    return 0;
+  }
+
+  if (args[0] == "verify" and args.size() >= 3) {
+    const std::string snapshot_path = args[1];
+    const std::string live_path = args[2];
+    VerifyOptions options;
+
+    for (size_t i = 3; i < args.size(); ++i) {
+      if (args[i] == "--no-digest") {
+        options.digest = false;
+      } else if (args[i] == "--checkpoint" and i + 1 < args.size()) {
+        options.walk.checkpoint_path = args[++i];
+      } else if (args[i] == "--threads" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.threads)) {
+        ++i;
+      } else if (args[i] == "--walk-threads" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.walk.threads)) {
+        ++i;
+      } else {
+        return -EINVAL;
+      }
+    }
+
+    command.run = [snapshot_path, live_path,
+                   options](std::shared_ptr<ceph_mount_info> mount) {
+      const auto start = std::chrono::steady_clock::now();
+      VerifyStats stats;
+
+      int result = VerifyTree(
+          mount, snapshot_path, live_path, options,
+          [&snapshot_path](const Mismatch& mismatch) {
+            LogMismatch(snapshot_path, mismatch);
+          },
+          &stats);
+
+      const double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+      LOG(kInfo) << "Verified " << snapshot_path << " against " << live_path
+                 << ": " << stats.entries << " entries, " << stats.mismatches
+                 << " mismatches, " << stats.errors << " errors, "
+                 << stats.digested_bytes << " bytes digested in " << seconds
+                 << "s";
+      return result;
+    };
+    return 0;
+  }
+
+  if (args[0] == "schedule" and args.size() >= 2) {
+    const std::string job_file = args[1];
+    SchedulerOptions options;
+    size_t budget = 0;
+
+    for (size_t i = 2; i < args.size(); ++i) {
+      if (args[i] == "--budget" and i + 1 < args.size() and
+          ParseCount(args[i + 1], budget)) {
+        options.default_budget = std::chrono::seconds(budget);
+        ++i;
+      } else if (args[i] == "--checkpoint-dir" and i + 1 < args.size()) {
+        options.checkpoint_dir = args[++i];
+      } else if (args[i] == "--jobs" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.jobs)) {
+        ++i;
+      } else if (args[i] == "--jobs-per-volume" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.jobs_per_volume)) {
+        ++i;
+      } else if (args[i] == "--mounts-per-volume" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.mounts_per_volume)) {
+        ++i;
+      } else if (args[i] == "--walk-threads" and i + 1 < args.size() and
+                 ParseCount(args[i + 1], options.walk_threads)) {
+        ++i;
+      } else {
+        return -EINVAL;
+      }
+    }
+
+    command.mount = false;
+    command.run = [job_file, options](std::shared_ptr<ceph_mount_info>) {
+      std::vector<Job> jobs;
+      int result = ParseJobFile(job_file, jobs);
+      if (result) {
+        return result;
+      }
+      return RunJobs(jobs, options);
+    };
+    return 0;
+  }
+
+  return -EINVAL;
+}
+
+int main(int argc, char** argv) {
+  Command command;
+
+  if (argc > 1) {
+    int result =
+        ParseCommand(std::vector<std::string>(argv + 1, argv + argc), command);
+    if (result) {
+      Usage();
+      return result;
+    }
+  }
+
+  if (command.run and not command.mount) {
+    return command.run(nullptr);
+  }
+
   std::shared_ptr<ceph_mount_info> mount;
   std::shared_ptr<UserPerm> user_perms;
 
   int result = Mount(mount, user_perms);
   if (result) {
-    std::cerr << "Failed to mount ceph: error " << -result << " ("
-              << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to mount ceph: error " << -result << " ("
+                << ::strerror(-result) << ")";
+    return result;
+  }
+
+  if (command.run) {
+    result = command.run(mount);
+    LogInodeRefs(mount);
     return result;
   }
 
@@ -424,14 +791,13 @@ int main(int, char**) {
       ceph_ll_walk(mount.get(), sub_volume_path.c_str(), &sub_volume_inode,
                    &sub_volume_sb, CEPH_STATX_ALL_STATS, 0, user_perms.get());
   if (result) {
-    std::cerr << "Failed to walk ceph path " << sub_volume_path << ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to walk ceph path " << sub_volume_path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_sub_volume_inode(
-      sub_volume_inode,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_sub_volume_inode =
+      ScopeInode(mount, sub_volume_inode, sub_volume_sb);
 
   const std::string snap_dir_name =
       "_" + snap_name + "_" + std::to_string(sub_volume_sb.stx_ino);
@@ -441,8 +807,8 @@ int main(int, char**) {
   result = ceph_statx(mount.get(), snap_path.c_str(), &snap_sb,
                       CEPH_STATX_ALL_STATS, 0);
   if (result) {
-    std::cerr << "Failed to statx snapshot path " << snap_path << ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to statx snapshot path " << snap_path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -450,9 +816,8 @@ int main(int, char**) {
 
   result = ceph_get_snap_info(mount.get(), snap_path.c_str(), &snap_info);
   if (result) {
-    std::cerr << "Failed to get snap info of snapshot path " << snap_path
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to get snap info of snapshot path " << snap_path
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -464,44 +829,41 @@ int main(int, char**) {
   Inode* test_dir_inode_snap = nullptr;
   result = ceph_ll_lookup_vino(mount.get(), vivo_dir, &test_dir_inode_snap);
   if (result) {
-    std::cerr << "Failed to lookup inode of directory {"
-              << std::to_string(vivo_dir.ino.val) << ", "
-              << std::to_string(vivo_dir.snapid.val) << "} in snapshot: error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to lookup inode of directory {"
+                << std::to_string(vivo_dir.ino.val) << ", "
+                << std::to_string(vivo_dir.snapid.val) << "} in snapshot: error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_test_dir_inode_snap(
-      test_dir_inode_snap,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_test_dir_inode_snap =
+      ScopeInode(mount, test_dir_inode_snap, vivo_dir);
 
   Inode* test_sub_dir_inode_snap = nullptr;
   result = ceph_ll_lookup_vino(mount.get(), vivo_sub_dir, &test_sub_dir_inode_snap);
   if (result) {
-    std::cerr << "Failed to lookup inode of sub directory {"
-              << std::to_string(vivo_sub_dir.ino.val) << ", "
-              << std::to_string(vivo_sub_dir.snapid.val) << "} in snapshot: error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to lookup inode of sub directory {"
+                << std::to_string(vivo_sub_dir.ino.val) << ", "
+                << std::to_string(vivo_sub_dir.snapid.val) << "} in snapshot: error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_test_sub_dir_inode_snap(
-      test_sub_dir_inode_snap,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_test_sub_dir_inode_snap =
+      ScopeInode(mount, test_sub_dir_inode_snap, vivo_sub_dir);
 
   Inode* test_file_inode_snap = nullptr;
   result = ceph_ll_lookup_vino(mount.get(), vivo_file, &test_file_inode_snap);
   if (result) {
-    std::cerr << "Failed to lookup inode of file {"
-              << std::to_string(vivo_file.ino.val) << ", "
-              << std::to_string(vivo_file.snapid.val) << "} in snapshot: error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to lookup inode of file {"
+                << std::to_string(vivo_file.ino.val) << ", "
+                << std::to_string(vivo_file.snapid.val) << "} in snapshot: error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_test_file_inode_snap(
-      test_file_inode_snap,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_test_file_inode_snap =
+      ScopeInode(mount, test_file_inode_snap, vivo_file);
 
 #if 0
     {
@@ -510,7 +872,7 @@ int main(int, char**) {
 
       result = ceph_statx(mount.get(), dir_snap_path.c_str(), &dir_sb_snap, CEPH_STATX_ALL_STATS, 0);
       if (result) {
-          std::cerr << "Failed to statx directory in snapshot " << dir_snap_path << ": error " << -result << " (" << ::strerror(-result) << ")" << std::endl;
+          LOG(kError) << "Failed to statx directory in snapshot " << dir_snap_path << ": error " << -result << " (" << ::strerror(-result) << ")";
           return result;
       }
     }
@@ -520,7 +882,7 @@ int main(int, char**) {
 
       result = ceph_statx(mount.get(), file_snap_path.c_str(), &file_sb_snap, CEPH_STATX_ALL_STATS, 0);
       if (result) {
-          std::cerr << "Failed to statx file in snapshot " << file_snap_path << ": error " << -result << " (" << ::strerror(-result) << ")" << std::endl;
+          LOG(kError) << "Failed to statx file in snapshot " << file_snap_path << ": error " << -result << " (" << ::strerror(-result) << ")";
           return result;
       }
     }
@@ -529,8 +891,8 @@ int main(int, char**) {
   result = ceph_statx(mount.get(), snap_dir.c_str(), &sb_snap_dir,
                       CEPH_STATX_ALL_STATS, 0);
   if (result) {
-    std::cerr << "Failed to statx snapshot dir " << snap_dir << ": error "
-              << -result << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to statx snapshot dir " << snap_dir << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -538,8 +900,8 @@ int main(int, char**) {
   result = ceph_ll_lookup_vino(
       mount.get(), {sb_snap_dir.stx_ino, sb_snap_dir.stx_dev}, &inode_snap_dir);
   if (result) {
-    std::cerr << "Failed to lookup inode of .snap directory error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to lookup inode of .snap directory error " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -549,15 +911,13 @@ int main(int, char**) {
                           &inode_snap_path, &sb_snap_path, CEPH_STATX_INO, 0,
                           user_perms.get());
   if (result) {
-    std::cerr << "Failed to lookup inode of snapshot path " << snap_dir_name
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to lookup inode of snapshot path " << snap_dir_name
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_inode_snap_path(
-      inode_snap_path,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_inode_snap_path =
+      ScopeInode(mount, inode_snap_path, sb_snap_path);
 
   {
     Inode* inode_ = nullptr;
@@ -566,14 +926,13 @@ int main(int, char**) {
     result = ceph_ll_lookup(mount.get(), inode_snap_path, dir_name.c_str(),
                             &inode_, &sb_, CEPH_STATX_INO, 0, user_perms.get());
     if (result) {
-      std::cerr << "Failed to lookup inode of snapshot sub directory "
-                << dir_name << ": error " << -result << " ("
-                << ::strerror(-result) << ")" << std::endl;
+      LOG(kError) << "Failed to lookup inode of snapshot sub directory "
+                  << dir_name << ": error " << -result << " ("
+                  << ::strerror(-result) << ")";
       return result;
     }
 
-    std::shared_ptr<Inode> scoped_inode_(
-        inode_, [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+    std::shared_ptr<Inode> scoped_inode_ = ScopeInode(mount, inode_, sb_);
   }
 
   {
@@ -583,14 +942,12 @@ int main(int, char**) {
     result = ceph_ll_lookup(mount.get(), inode_snap_path, file_name.c_str(),
                             &inode_, &sb_, CEPH_STATX_INO, 0, user_perms.get());
     if (result) {
-      std::cerr << "Failed to lookup inode of snapshot file " << dir_name
-                << ": error " << -result << " (" << ::strerror(-result) << ")"
-                << std::endl;
+      LOG(kError) << "Failed to lookup inode of snapshot file " << dir_name
+                  << ": error " << -result << " (" << ::strerror(-result) << ")";
       return result;
     }
 
-    std::shared_ptr<Inode> scoped_inode_(
-        inode_, [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+    std::shared_ptr<Inode> scoped_inode_ = ScopeInode(mount, inode_, sb_);
   }
 #elif 1
 
@@ -614,14 +971,13 @@ int main(int, char**) {
   Inode* inode_live_dir = nullptr;
   result = ceph_ll_lookup_vino(mount.get(), vivo_live_dir, &inode_live_dir);
   if (result) {
-    std::cerr << "Failed to lookup inode of the live directory " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to lookup inode of the live directory " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_inode_live_dir(
-      inode_live_dir,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_inode_live_dir =
+      ScopeInode(mount, inode_live_dir, vivo_live_dir);
 
   {
     struct ceph_statx sb;
@@ -629,13 +985,12 @@ int main(int, char**) {
     result = ceph_ll_getattr(mount.get(), inode_live_dir, &sb, CEPH_STATX_MODE,
                              0, user_perms.get());
     if (result < 0) {
-      std::cerr << "Failed to stat deleted directory"
-                << ": error " << -result << " (" << ::strerror(-result) << ")"
-                << std::endl;
+      LOG(kError) << "Failed to stat deleted directory"
+                  << ": error " << -result << " (" << ::strerror(-result) << ")";
     }
 
     if (not S_ISDIR(sb.stx_mode)) {
-      std::cerr << "Failed to read type of deleted directory" << std::endl;
+      LOG(kError) << "Failed to read type of deleted directory";
     }
   }
 
@@ -646,21 +1001,18 @@ int main(int, char**) {
       ceph_ll_lookup(mount.get(), inode_live_dir, ".snap", &inode_snap_the_dir,
                      &sb, CEPH_STATX_INO, 0, user_perms.get());
   if (result) {
-    std::cerr << "Filed to lookup .snap in live directory"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Filed to lookup .snap in live directory"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::shared_ptr<Inode> scoped_inode_snap_the_dir(
-      inode_snap_the_dir,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  std::shared_ptr<Inode> scoped_inode_snap_the_dir =
+      ScopeInode(mount, inode_snap_the_dir, sb);
 
   result = ReadDir(mount, scoped_inode_snap_the_dir, ecb);
   if (not scoped_inode_the_snap) {
-    std::cerr << "Failed to find snapshot in the .snap"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to find snapshot in the .snap"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -669,15 +1021,13 @@ int main(int, char**) {
   result = ceph_ll_lookup(mount.get(), scoped_inode_snap_the_dir.get(),
   name_the_snap.c_str(), &inode_dir_target, &sb, CEPH_STATX_INO, 0,
   user_perms.get()); if (result) {
-    std::cerr << "Failed to look up " << name_the_snap << ": error " <<
-    -result << " (" << ::strerror(-result) << ")" << std::endl; return
+    LOG(kError) << "Failed to look up " << name_the_snap << ": error " <<
+    -result << " (" << ::strerror(-result) << ")"; return
     result;
   }
 
-  std::shared_ptr<Inode> scoped_inode_dir_target(inode_dir_target,
-  [mount](Inode* inode) {
-    ceph_ll_put(mount.get(), inode);
-  });
+  std::shared_ptr<Inode> scoped_inode_dir_target =
+      ScopeInode(mount, inode_dir_target, sb);
 
 #elif 0
   struct ceph_statx sb_fs;
@@ -686,8 +1036,8 @@ int main(int, char**) {
   result = ceph_ll_walk(mount.get(), fs_path.c_str(), &inode_fs, &sb_fs,
                         CEPH_STATX_ALL_STATS, 0, user_perms.get());
   if (result) {
-    std::cerr << "Failed to walk ceph path " << fs_path << ": error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to walk ceph path " << fs_path << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -697,14 +1047,12 @@ int main(int, char**) {
   result = ceph_ll_lookup(mount.get(), inode_fs, ".snap", &inode_snap_dir,
                           &sb_snap_dir, CEPH_STATX_INO, 0, user_perms.get());
   if (result) {
-    std::cerr << "Failed to lookup inode of .snap directory: error " << -result
-              << " (" << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to lookup inode of .snap directory: error " << -result
+                << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  auto scoped_inode_snap_dir = std::shared_ptr<Inode>(
-      inode_snap_dir,
-      [mount](Inode* inode) { ceph_ll_put(mount.get(), inode); });
+  auto scoped_inode_snap_dir = ScopeInode(mount, inode_snap_dir, sb_snap_dir);
 
   std::shared_ptr<Inode> scoped_inode_parent;
 
@@ -720,9 +1068,8 @@ int main(int, char**) {
 
   result = ReadDir(mount, scoped_inode_snap_dir, ecb);
   if (not scoped_inode_parent) {
-    std::cerr << "Failed to find snapshot inode"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to find snapshot inode"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
@@ -762,12 +1109,12 @@ int main(int, char**) {
   }
 
   if (not scoped_inode_my) {
-    std::cerr << "Not found snapshot inode" << std::endl;
+    LOG(kError) << "Not found snapshot inode";
     return -EINVAL;
   }
 
   if (scoped_inode_my.get() != test_dir_inode_snap) {
-    std::cerr << "Mismatched snapshot file handles" << std::endl;
+    LOG(kError) << "Mismatched snapshot file handles";
     return -EINVAL;
   }
 
@@ -779,9 +1126,9 @@ int main(int, char**) {
   result = ceph_ll_getxattr(mount.get(), test_dir_inode_snap, new_xattr_name,
                             nullptr, 0, user_perms.get());
   if (result < 0) {
-    std::cerr << "Failed to get length of snapshot dir's xattr "
-              << new_xattr_name << ": error " << -result << " ("
-              << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to get length of snapshot dir's xattr "
+                << new_xattr_name << ": error " << -result << " ("
+                << ::strerror(-result) << ")";
     return result;
   }
 
@@ -790,14 +1137,12 @@ int main(int, char**) {
   result = ceph_ll_getxattr(mount.get(), test_dir_inode_snap, new_xattr_name,
                             xattr_read.data(), result, user_perms.get());
   if (result < 0) {
-    std::cerr << "Failed to get snapshot dir's xattr " << new_xattr_name
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to get snapshot dir's xattr " << new_xattr_name
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::cerr << "xattr of dir in snapshot: " << snap_id << " is: " << xattr_read
-            << std::endl;
+  LOG(kInfo) << "xattr of dir in snapshot: " << snap_id << " is: " << xattr_read;
 
   bool found_sub_dir = false;
   auto sub_dir_ecb = [&sub_dir_sb, &found_sub_dir](
@@ -805,7 +1150,7 @@ int main(int, char**) {
                   std::shared_ptr<Inode> inode) {
     bool next = true;
 
-    std::cout << "searching snapshotted directory: " << name << std::endl;
+    LOG(kInfo) << "searching snapshotted directory: " << name;
 
     if (sb.stx_ino == sub_dir_sb.stx_ino) {
       found_sub_dir = true;
@@ -817,18 +1162,17 @@ int main(int, char**) {
 
   result = ReadDir(mount, scoped_test_dir_inode_snap, sub_dir_ecb);
   if (not found_sub_dir) {
-    std::cerr << "Failed to find sub-dir in snapshot"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to find sub-dir in snapshot"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     // return result;
   }
 
   result = ceph_ll_getxattr(mount.get(), test_sub_dir_inode_snap, new_xattr_name,
                             nullptr, 0, user_perms.get());
   if (result < 0) {
-    std::cerr << "Failed to get length of snapshot sub-dir's xattr "
-              << new_xattr_name << ": error " << -result << " ("
-              << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to get length of snapshot sub-dir's xattr "
+                << new_xattr_name << ": error " << -result << " ("
+                << ::strerror(-result) << ")";
     // return result;
   } else {
     xattr_read.resize(result + 1, '\0');
@@ -836,22 +1180,20 @@ int main(int, char**) {
     result = ceph_ll_getxattr(mount.get(), test_sub_dir_inode_snap, new_xattr_name,
                               xattr_read.data(), result, user_perms.get());
     if (result < 0) {
-      std::cerr << "Failed to get snapshot sub-dir's xattr " << new_xattr_name
-                << ": error " << -result << " (" << ::strerror(-result) << ")"
-                << std::endl;
+      LOG(kError) << "Failed to get snapshot sub-dir's xattr " << new_xattr_name
+                  << ": error " << -result << " (" << ::strerror(-result) << ")";
       return result;
     }
 
-    std::cerr << "xattr of sub-dir in snapshot: " << snap_id << " is: " << xattr_read
-              << std::endl;
+    LOG(kInfo) << "xattr of sub-dir in snapshot: " << snap_id << " is: " << xattr_read;
   }
 
   result = ceph_ll_getxattr(mount.get(), test_file_inode_snap, new_xattr_name,
                             nullptr, 0, user_perms.get());
   if (result < 0) {
-    std::cerr << "Failed to get length of snapshot file's xattr "
-              << new_xattr_name << ": error " << -result << " ("
-              << ::strerror(-result) << ")" << std::endl;
+    LOG(kError) << "Failed to get length of snapshot file's xattr "
+                << new_xattr_name << ": error " << -result << " ("
+                << ::strerror(-result) << ")";
     return result;
   }
 
@@ -860,43 +1202,38 @@ int main(int, char**) {
   result = ceph_ll_getxattr(mount.get(), test_file_inode_snap, new_xattr_name,
                             xattr_read.data(), result, user_perms.get());
   if (result < 0) {
-    std::cerr << "Failed to get snapshot file's xattr " << new_xattr_name
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to get snapshot file's xattr " << new_xattr_name
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::cerr << "xattr of file in snapshot: " << snap_id << " is: " << xattr_read
-            << std::endl;
+  LOG(kInfo) << "xattr of file in snapshot: " << snap_id << " is: " << xattr_read;
 
   Fh* fh_snap = nullptr;
   result = ceph_ll_open(mount.get(), test_file_inode_snap, O_RDONLY, &fh_snap,
                         user_perms.get());
   if (result < 0) {
-    std::cerr << "Failed to open snapshot file"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to open snapshot file"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   std::string buf(10, '\0');
   result = ceph_ll_read(mount.get(), fh_snap, 0, 9, buf.data());
   if (result != 9) {
-    std::cerr << "Failed to read snapshot file"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to read snapshot file"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
   result = ceph_ll_close(mount.get(), fh_snap);
   if (result) {
-    std::cerr << "Failed to close snapshot file"
-              << ": error " << -result << " (" << ::strerror(-result) << ")"
-              << std::endl;
+    LOG(kError) << "Failed to close snapshot file"
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
     return result;
   }
 
-  std::cerr << "content of file in snapshot: " << buf << std::endl;
+  LOG(kInfo) << "content of file in snapshot: " << buf;
 
   return 0;
 }
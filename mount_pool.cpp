@@ -0,0 +1,53 @@
+#include "mount_pool.h"
+
+#include <algorithm>
+
+#include "client.h"
+#include "inode_refs.h"
+
+MountPool::MountPool(size_t mounts_per_volume, std::string uuid_prefix)
+    : mounts_per_volume_(std::max<size_t>(1, mounts_per_volume)),
+      uuid_prefix_(std::move(uuid_prefix)) {}
+
+int MountPool::Get(const std::string& volume,
+                   std::shared_ptr<ceph_mount_info>& mount) {
+  Volume* entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& slot = volumes_[volume];
+    if (not slot) {
+      slot = std::make_unique<Volume>();
+    }
+    entry = slot.get();
+  }
+
+  std::lock_guard<std::mutex> lock(entry->mutex);
+
+  if (entry->mounts.size() < mounts_per_volume_) {
+    // A stable uuid per slot lets a restarted run reclaim its old sessions
+    const std::string uuid = uuid_prefix_ + "-" + volume + "-" +
+                             std::to_string(entry->mounts.size());
+    std::shared_ptr<UserPerm> user_perms;
+
+    int result = Mount(mount, user_perms, volume, uuid);
+    if (result) {
+      return result;
+    }
+
+    entry->mounts.push_back(mount);
+    return 0;
+  }
+
+  mount = entry->mounts[entry->next++ % entry->mounts.size()];
+  return 0;
+}
+
+void MountPool::LogInodeRefs() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [name, volume] : volumes_) {
+    std::lock_guard<std::mutex> volume_lock(volume->mutex);
+    for (size_t i = 0; i < volume->mounts.size(); ++i) {
+      ::LogInodeRefs(volume->mounts[i], name + "#" + std::to_string(i));
+    }
+  }
+}
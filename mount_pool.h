@@ -0,0 +1,39 @@
+#ifndef TESTSNAPSHOT_MOUNT_POOL_H_
+#define TESTSNAPSHOT_MOUNT_POOL_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Mounts shared between jobs, up to `mounts_per_volume` per file system,
+// handed out round robin. Each mount pays Mount() and the reclaim handshake
+// once and then serves every job on its volume with a warm client cache.
+class MountPool {
+ public:
+  MountPool(size_t mounts_per_volume, std::string uuid_prefix);
+
+  int Get(const std::string& volume, std::shared_ptr<ceph_mount_info>& mount);
+
+  // LogInodeRefs() for every mount.
+  void LogInodeRefs();
+
+ private:
+  struct Volume {
+    std::mutex mutex;  // Held while mounting; other volumes are unaffected
+    std::vector<std::shared_ptr<ceph_mount_info>> mounts;
+    size_t next = 0;
+  };
+
+  const size_t mounts_per_volume_;
+  const std::string uuid_prefix_;
+
+  std::mutex mutex_;
+  std::map<std::string, std::unique_ptr<Volume>> volumes_;
+};
+
+#endif  // TESTSNAPSHOT_MOUNT_POOL_H_
@@ -0,0 +1,596 @@
+#include "scheduler.h"
+
+#include <cephfs/libcephfs.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+#include "archive.h"
+#include "client.h"
+#include "log.h"
+#include "mount_pool.h"
+#include "sparse.h"
+#include "thread_pool.h"
+#include "verify.h"
+#include "walker.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const char* ActionName(JobAction action) {
+  switch (action) {
+    case JobAction::kCreate:
+      return "create";
+    case JobAction::kVerify:
+      return "verify";
+    case JobAction::kExport:
+      return "export";
+  }
+  return "unknown";
+}
+
+// Names end up in ceph command lines and checkpoint file names
+bool ValidName(const std::string& name) {
+  if (name.empty()) {
+    return false;
+  }
+  for (char c : name) {
+    if (not std::isalnum(static_cast<unsigned char>(c)) and c != '-' and
+        c != '_' and c != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string Describe(const Job& job) {
+  std::string description = ActionName(job.action);
+  description += " " + job.volume + "/";
+  if (not job.group.empty()) {
+    description += job.group + "/";
+  }
+  return description + job.subvolume + "@" + job.snapshot;
+}
+
+bool IsArchive(const std::string& target) {
+  const std::string suffix = ".zst";
+  return target.size() > suffix.size() and
+         target.compare(target.size() - suffix.size(), suffix.size(),
+                        suffix) == 0;
+}
+
+std::string GroupOption(const Job& job) {
+  return job.group.empty() ? "" : " --group_name " + job.group;
+}
+
+// Run a ceph CLI command, capturing its standard output.
+int RunCommand(const std::string& command, std::string& output) {
+  LOG(kDebug) << command;
+  FlushLog();
+
+  FILE* pipe = ::popen(command.c_str(), "r");
+  if (not pipe) {
+    const int result = -errno;
+    LOG(kError) << "Failed to run " << command << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  char buf[4096];
+  size_t n;
+  while ((n = std::fread(buf, 1, sizeof(buf), pipe)) > 0) {
+    output.append(buf, n);
+  }
+
+  const int status = ::pclose(pipe);
+  if (status == -1 or not WIFEXITED(status) or WEXITSTATUS(status)) {
+    // The ceph CLI exits with the errno of the failed request
+    const int result =
+        status != -1 and WIFEXITED(status) ? -WEXITSTATUS(status) : -EIO;
+    LOG(kError) << "Failed to run " << command << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  while (not output.empty() and
+         std::isspace(static_cast<unsigned char>(output.back()))) {
+    output.pop_back();
+  }
+  return 0;
+}
+
+int CreateSnapshot(const Job& job) {
+  std::string output;
+  return RunCommand("ceph fs subvolume snapshot create " + job.volume + " " +
+                        job.subvolume + " " + job.snapshot + GroupOption(job),
+                    output);
+}
+
+// Find the root of the snapshot as seen from the subvolume's data
+// directory, e.g. <fs_path>/.snap/_<snapshot>_<subvolume inode>, and the
+// paths of both.
+int FindSnapshot(std::shared_ptr<ceph_mount_info> mount, const Job& job,
+                 vinodeno_t& root, std::string& snap_path,
+                 std::string& fs_path) {
+  int result = RunCommand("ceph fs subvolume getpath " + job.volume + " " +
+                              job.subvolume + GroupOption(job),
+                          fs_path);
+  if (result) {
+    return result;
+  }
+
+  const size_t slash = fs_path.find_last_of('/');
+  if (fs_path.empty() or slash == std::string::npos or slash == 0) {
+    LOG(kError) << "Unexpected path " << fs_path << " of subvolume "
+                << job.subvolume;
+    return -EINVAL;
+  }
+
+  std::shared_ptr<Inode> scoped_inode;
+  struct ceph_statx sb;
+
+  result = WalkPath(mount, fs_path.substr(0, slash), scoped_inode, sb);
+  if (result) {
+    return result;
+  }
+
+  snap_path = fs_path + "/.snap/_" + job.snapshot + "_" +
+              std::to_string(sb.stx_ino);
+
+  result = WalkPath(mount, snap_path, scoped_inode, sb);
+  if (result) {
+    return result;
+  }
+
+  root = {{sb.stx_ino}, {sb.stx_dev}};
+  return 0;
+}
+
+// Write one snapshot entry below `target`. Entries delivered again after a
+// resume are overwritten.
+int ExportEntry(std::shared_ptr<ceph_mount_info> mount,
+                const std::string& target, const std::string& path,
+                const struct ceph_statx& sb, Inode* inode) {
+  const std::string local = target + "/" + path;
+
+  if (S_ISDIR(sb.stx_mode)) {
+    if (::mkdir(local.c_str(), (sb.stx_mode & 07777) | S_IRWXU) and
+        errno != EEXIST) {
+      const int result = -errno;
+      LOG(kError) << "Failed to create directory " << local << ": error "
+                  << -result << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+    return 0;
+  }
+
+  if (S_ISLNK(sb.stx_mode)) {
+    std::string link(sb.stx_size ? sb.stx_size : PATH_MAX, '\0');
+
+    int result = ceph_ll_readlink(mount.get(), inode, link.data(), link.size(),
+                                  ceph_mount_perms(mount.get()));
+    if (result < 0) {
+      LOG(kError) << "Failed to read link " << path << ": error " << -result
+                  << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+    link.resize(result);
+
+    ::unlink(local.c_str());
+    if (::symlink(link.c_str(), local.c_str())) {
+      result = -errno;
+      LOG(kError) << "Failed to create link " << local << ": error "
+                  << -result << " (" << ::strerror(-result) << ")";
+      return result;
+    }
+    return 0;
+  }
+
+  if (not S_ISREG(sb.stx_mode)) {
+    LOG(kWarn) << "Not exporting special file " << path;
+    return 0;
+  }
+
+  Fh* fh = nullptr;
+  int result = ceph_ll_open(mount.get(), inode, O_RDONLY, &fh,
+                            ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    LOG(kError) << "Failed to open " << path << ": error " << -result << " ("
+                << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<Fh> scoped_fh(
+      fh, [mount](Fh* fh) { ceph_ll_close(mount.get(), fh); });
+
+  const int fd = ::open(local.c_str(), O_CREAT | O_TRUNC | O_WRONLY,
+                        sb.stx_mode & 07777);
+  if (fd < 0) {
+    result = -errno;
+    LOG(kError) << "Failed to create file " << local << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<void> scoped_fd(nullptr, [fd](void*) { ::close(fd); });
+
+  result = ReadSparse(
+      mount, fh, sb.stx_size,
+      [fd, &local](uint64_t offset, const char* data, size_t size) {
+        for (size_t done = 0; done < size;) {
+          const ssize_t n = ::pwrite(fd, data + done, size - done,
+                                     offset + done);
+          if (n < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            const int result = -errno;
+            LOG(kError) << "Failed to write " << local << ": error "
+                        << -result << " (" << ::strerror(-result) << ")";
+            return result;
+          }
+          done += n;
+        }
+        return 0;
+      });
+  if (result) {
+    return result;
+  }
+
+  // Holes were skipped, so set the size explicitly
+  if (::ftruncate(fd, sb.stx_size)) {
+    result = -errno;
+    LOG(kError) << "Failed to set size of " << local << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+  return 0;
+}
+
+std::string CheckpointPath(const Job& job, const SchedulerOptions& options) {
+  return options.checkpoint_dir + "/" + job.volume + "." +
+         (job.group.empty() ? "_nogroup" : job.group) + "." + job.subvolume +
+         "." + job.snapshot + "." + ActionName(job.action) + ".walk";
+}
+
+// Compare the job's snapshot with the live subvolume, logging every
+// mismatch. Stops with -ETIMEDOUT at `deadline`.
+int VerifySnapshot(std::shared_ptr<ceph_mount_info> mount, const Job& job,
+                   const SchedulerOptions& options,
+                   Clock::time_point deadline, uint64_t& entries) {
+  vinodeno_t root;
+  std::string snap_path;
+  std::string fs_path;
+
+  int result = FindSnapshot(mount, job, root, snap_path, fs_path);
+  if (result) {
+    return result;
+  }
+
+  VerifyOptions verify_options;
+  verify_options.walk.threads = options.walk_threads;
+  verify_options.threads = options.walk_threads * 4;
+  verify_options.deadline = deadline;
+  if (not options.checkpoint_dir.empty()) {
+    verify_options.walk.checkpoint_path = CheckpointPath(job, options);
+  }
+
+  const std::string description = Describe(job);
+  VerifyStats stats;
+
+  result = VerifyTree(
+      mount, snap_path, fs_path, verify_options,
+      [&description](const Mismatch& mismatch) {
+        LogMismatch(description, mismatch);
+      },
+      &stats);
+
+  entries = stats.entries;
+  if (stats.mismatches) {
+    LOG(kError) << description << ": " << stats.mismatches
+                << " mismatches in " << stats.entries << " entries";
+  }
+  return result;
+}
+
+// Walk the job's snapshot, exporting each entry. Stops with -ETIMEDOUT at
+// `deadline`.
+int ExportSnapshot(std::shared_ptr<ceph_mount_info> mount, const Job& job,
+                   const SchedulerOptions& options,
+                   Clock::time_point deadline, uint64_t& entries) {
+  vinodeno_t root;
+  std::string snap_path;
+  std::string fs_path;
+
+  int result = FindSnapshot(mount, job, root, snap_path, fs_path);
+  if (result) {
+    return result;
+  }
+
+  // Exports to a .zst target are written as one archive, which cannot be
+  // resumed, so those walks are not checkpointed
+  std::unique_ptr<ArchiveWriter> archive;
+
+  if (IsArchive(job.target)) {
+    ArchiveOptions archive_options;
+    archive_options.threads = options.walk_threads;
+    archive = std::make_unique<ArchiveWriter>(mount, archive_options);
+
+    result = archive->Open(job.target);
+    if (result) {
+      return result;
+    }
+  } else if (::mkdir(job.target.c_str(), 0755) and errno != EEXIST) {
+    result = -errno;
+    LOG(kError) << "Failed to create directory " << job.target << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  WalkOptions walk_options;
+  walk_options.threads = options.walk_threads;
+  if (not options.checkpoint_dir.empty() and not archive) {
+    walk_options.checkpoint_path = CheckpointPath(job, options);
+  }
+
+  std::atomic<bool> timed_out{false};
+  std::atomic<int> error{0};
+  WalkStats stats;
+
+  result = WalkTree(
+      mount, root, walk_options,
+      [&](const std::string& path, const struct ceph_statx& sb,
+          std::shared_ptr<Inode> inode) {
+        if (Clock::now() >= deadline) {
+          timed_out = true;
+          return false;
+        }
+        int result = archive ? archive->Add(path, sb, inode)
+                             : ExportEntry(mount, job.target, path, sb,
+                                           inode.get());
+        if (result) {
+          error = result;
+          return false;
+        }
+        return true;
+      },
+      &stats);
+
+  entries = stats.entries;
+
+  if (archive) {
+    const int finish_result = archive->Finish();
+    if (result == 0) {
+      result = finish_result;
+    }
+  }
+
+  if (error) {
+    return error;
+  }
+  if (result == -ECANCELED and timed_out) {
+    return -ETIMEDOUT;
+  }
+  return result;
+}
+
+int RunJob(MountPool& mounts, const Job& job, const SchedulerOptions& options,
+           uint64_t& entries) {
+  if (job.action == JobAction::kCreate) {
+    return CreateSnapshot(job);
+  }
+
+  const auto budget =
+      job.budget.count() ? job.budget : options.default_budget;
+  const auto deadline = Clock::now() + budget;
+
+  std::shared_ptr<ceph_mount_info> mount;
+
+  int result = mounts.Get(job.volume, mount);
+  if (result) {
+    LOG(kError) << "Failed to mount volume " << job.volume << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  if (job.action == JobAction::kVerify) {
+    return VerifySnapshot(mount, job, options, deadline, entries);
+  }
+  return ExportSnapshot(mount, job, options, deadline, entries);
+}
+
+}  // namespace
+
+int ParseJobFile(const std::string& path, std::vector<Job>& jobs) {
+  std::ifstream file(path);
+  if (not file) {
+    const int result = -errno;
+    LOG(kError) << "Failed to open job file " << path << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::string line;
+  for (size_t number = 1; std::getline(file, line); ++number) {
+    std::istringstream fields(line);
+    std::string action;
+    Job job;
+
+    if (not(fields >> job.volume) or job.volume[0] == '#') {
+      continue;
+    }
+
+    bool valid = bool(fields >> job.subvolume >> action >> job.snapshot) and
+                 ValidName(job.volume) and ValidName(job.subvolume) and
+                 ValidName(job.snapshot);
+
+    if (action == "create") {
+      job.action = JobAction::kCreate;
+    } else if (action == "verify") {
+      job.action = JobAction::kVerify;
+    } else if (action == "export") {
+      job.action = JobAction::kExport;
+    } else {
+      valid = false;
+    }
+
+    std::string option;
+    while (valid and fields >> option) {
+      const size_t equals = option.find('=');
+      const std::string key = option.substr(0, equals);
+      const std::string value =
+          equals == std::string::npos ? "" : option.substr(equals + 1);
+
+      if (key == "group" and ValidName(value)) {
+        job.group = value;
+      } else if (key == "target" and not value.empty()) {
+        job.target = value;
+      } else if (key == "budget" and not value.empty()) {
+        char* end = nullptr;
+        job.budget =
+            std::chrono::seconds(std::strtoull(value.c_str(), &end, 10));
+        valid = *end == '\0';
+      } else {
+        valid = false;
+      }
+    }
+
+    if (job.action == JobAction::kExport and job.target.empty()) {
+      valid = false;
+    }
+
+    if (not valid) {
+      LOG(kError) << "Invalid job at " << path << ":" << number << ": "
+                  << line;
+      return -EINVAL;
+    }
+
+    jobs.push_back(std::move(job));
+  }
+
+  return 0;
+}
+
+int RunJobs(const std::vector<Job>& jobs, const SchedulerOptions& options) {
+  struct Volume {
+    std::deque<size_t> queue;  // Indexes of jobs not started yet
+    size_t running = 0;
+  };
+
+  std::map<std::string, Volume> volumes;
+  std::vector<Volume*> order;
+
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    auto inserted = volumes.emplace(jobs[i].volume, Volume());
+    if (inserted.second) {
+      order.push_back(&inserted.first->second);
+    }
+    inserted.first->second.queue.push_back(i);
+  }
+
+  const size_t per_volume = std::max<size_t>(1, options.jobs_per_volume);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t running = 0;
+  size_t succeeded = 0;
+  size_t timed_out = 0;
+  int first_error = 0;
+
+  MountPool mounts(options.mounts_per_volume, client_uuid);
+  // Declared last so its threads are joined before anything they use goes
+  ThreadPool pool(std::max<size_t>(1, options.jobs));
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for (size_t pending = jobs.size(), next = 0; pending;) {
+    // Start the next job of the first volume, after the one served last,
+    // that has work and a free slot
+    Volume* volume = nullptr;
+    for (size_t k = 0; running < pool.size() and k < order.size(); ++k) {
+      Volume* candidate = order[(next + k) % order.size()];
+      if (not candidate->queue.empty() and candidate->running < per_volume) {
+        volume = candidate;
+        next = (next + k + 1) % order.size();
+        break;
+      }
+    }
+
+    if (not volume) {
+      cv.wait(lock);
+      continue;
+    }
+
+    const size_t index = volume->queue.front();
+    volume->queue.pop_front();
+    ++volume->running;
+    ++running;
+    --pending;
+
+    pool.Post([&, volume, index] {
+      const Job& job = jobs[index];
+      const auto start = Clock::now();
+      uint64_t entries = 0;
+
+      const int result = RunJob(mounts, job, options, entries);
+
+      const double seconds =
+          std::chrono::duration<double>(Clock::now() - start).count();
+      if (result == 0) {
+        LOG(kInfo) << "Job " << index + 1 << " " << Describe(job)
+                   << " succeeded in " << seconds << "s"
+                   << (job.action == JobAction::kCreate
+                           ? ""
+                           : ", " + std::to_string(entries) + " entries");
+      } else if (result == -ETIMEDOUT) {
+        LOG(kWarn) << "Job " << index + 1 << " " << Describe(job)
+                   << " ran out of time after " << entries << " entries";
+      } else {
+        LOG(kError) << "Job " << index + 1 << " " << Describe(job)
+                    << " failed: error " << -result << " ("
+                    << ::strerror(-result) << ")";
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      --volume->running;
+      --running;
+      if (result == 0) {
+        ++succeeded;
+      } else {
+        timed_out += result == -ETIMEDOUT;
+        if (not first_error) {
+          first_error = result;
+        }
+      }
+      cv.notify_one();
+    });
+  }
+
+  cv.wait(lock, [&] { return running == 0; });
+
+  mounts.LogInodeRefs();
+
+  LOG(kInfo) << "Ran " << jobs.size() << " jobs on " << volumes.size()
+             << " volumes: " << succeeded << " succeeded, " << timed_out
+             << " out of time, " << jobs.size() - succeeded - timed_out
+             << " failed";
+  return first_error;
+}
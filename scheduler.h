@@ -0,0 +1,52 @@
+#ifndef TESTSNAPSHOT_SCHEDULER_H_
+#define TESTSNAPSHOT_SCHEDULER_H_
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+enum class JobAction { kCreate, kVerify, kExport };
+
+struct Job {
+  std::string volume;
+  std::string group;  // Empty for subvolumes outside a group
+  std::string subvolume;
+  JobAction action;
+  std::string snapshot;
+  // Local directory an export is written to, or an archive when it ends
+  // in .zst
+  std::string target;
+  std::chrono::seconds budget{0};  // 0 for SchedulerOptions::default_budget
+};
+
+struct SchedulerOptions {
+  size_t jobs = 16;  // Jobs running at once
+  // At most this many of them on one volume, so a volume with many jobs
+  // cannot hold up the others.
+  size_t jobs_per_volume = 4;
+  size_t mounts_per_volume = 2;
+  size_t walk_threads = 4;
+  std::chrono::seconds default_budget{600};
+  // When set, verify and export walks are checkpointed here, so a job that
+  // ran out of time carries on from where it stopped on the next run.
+  std::string checkpoint_dir;
+};
+
+// Read jobs from `path`, one per line:
+//
+//   <volume> <subvolume> create|verify|export <snapshot>
+//       [group=<group>] [budget=<seconds>] [target=<dir>]
+//
+// Blank lines and lines starting with '#' are ignored. Exports need a
+// target.
+int ParseJobFile(const std::string& path, std::vector<Job>& jobs);
+
+// Run `jobs` over a shared pool of mounts, handing out free slots round
+// robin across volumes. A verify compares the snapshot with the live
+// subvolume entry by entry. Every verify or export walk is stopped once its
+// budget is spent. Returns 0 if every job succeeded, otherwise the error
+// of the first one that failed.
+int RunJobs(const std::vector<Job>& jobs, const SchedulerOptions& options);
+
+#endif  // TESTSNAPSHOT_SCHEDULER_H_
@@ -0,0 +1,183 @@
+#include "small_file_reader.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "inode_refs.h"
+#include "log.h"
+
+SmallFileReader::SmallFileReader(std::shared_ptr<ceph_mount_info> mount,
+                                 const SmallFileOptions& options,
+                                 BatchCallback callback)
+    : mount_(mount),
+      refs_(GetInodeRefs(mount.get())),
+      options_(options),
+      callback_(std::move(callback)),
+      pool_(std::max<size_t>(1, options.in_flight)) {}
+
+SmallFileReader::~SmallFileReader() { Finish(); }
+
+int SmallFileReader::Add(const std::string& path, const struct ceph_statx& sb,
+                         std::shared_ptr<Inode> inode) {
+  if (sb.stx_size > options_.max_file_size) {
+    return -EFBIG;
+  }
+
+  // Queued files stay pinned until read
+  WaitForInodeBudget(*refs_);
+
+  const size_t size = sb.stx_size;
+  std::shared_ptr<Batch> batch;
+  size_t index;
+  bool sealed = false;
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return error_ or in_flight_ < pool_.size(); });
+    if (error_) {
+      return error_;
+    }
+
+    if (batches_.empty() or batches_.back()->sealed or
+        batches_.back()->used + size > batches_.back()->batch.data.size()) {
+      if (not batches_.empty() and not batches_.back()->sealed) {
+        batches_.back()->sealed = true;
+        sealed = true;
+      }
+      batches_.push_back(std::make_shared<Batch>());
+      batches_.back()->batch.data.resize(
+          std::max<size_t>(options_.batch_bytes, size));
+    }
+
+    batch = batches_.back();
+    index = batch->batch.files.size();
+    batch->batch.files.push_back({path, sb, batch->used, size, 0});
+    batch->used += size;
+    ++batch->pending;
+    ++in_flight_;
+  }
+
+  pool_.Post([this, batch, index, inode] { Read(batch, index, inode); });
+
+  if (sealed) {
+    Deliver();  // The previous batch may already be complete
+  }
+  return 0;
+}
+
+int SmallFileReader::Finish() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not batches_.empty()) {
+      batches_.back()->sealed = true;
+    }
+  }
+
+  Deliver();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return batches_.empty(); });
+  lock.unlock();
+
+  // Wait out a callback for the last batch still running elsewhere
+  std::lock_guard<std::mutex> deliver_lock(deliver_mutex_);
+  lock.lock();
+  return error_;
+}
+
+void SmallFileReader::Read(std::shared_ptr<Batch> batch, size_t index,
+                           std::shared_ptr<Inode> inode) {
+  std::string path;
+  uint64_t size;
+  char* data;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const PackedFile& file = batch->batch.files[index];
+    path = file.path;
+    size = file.size;
+    data = batch->batch.data.data() + file.offset;
+  }
+
+  uint64_t got = 0;
+  int result = 0;
+
+  // Nothing to read in an empty file; the readdirplus stat was enough
+  if (size) {
+    Fh* fh = nullptr;
+    result = ceph_ll_open(mount_.get(), inode.get(), O_RDONLY, &fh,
+                          ceph_mount_perms(mount_.get()));
+    if (result < 0) {
+      LOG(kError) << "Failed to open " << path << ": error " << -result
+                  << " (" << ::strerror(-result) << ")";
+    } else {
+      // One request covers the whole file; loop only on a short read
+      while (got < size) {
+        result = ceph_ll_read(mount_.get(), fh, got, size - got, data + got);
+        if (result <= 0) {
+          break;
+        }
+        got += result;
+      }
+      if (result < 0) {
+        LOG(kError) << "Failed to read " << path << ": error " << -result
+                    << " (" << ::strerror(-result) << ")";
+      } else {
+        result = 0;
+      }
+      ceph_ll_close(mount_.get(), fh);
+    }
+  }
+
+  inode.reset();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PackedFile& file = batch->batch.files[index];
+    file.result = result;
+    file.size = result ? 0 : got;
+    --batch->pending;
+    --in_flight_;
+  }
+  cv_.notify_all();
+
+  Deliver();
+}
+
+void SmallFileReader::Deliver() {
+  std::lock_guard<std::mutex> deliver_lock(deliver_mutex_);
+
+  while (true) {
+    std::shared_ptr<Batch> batch;
+    bool skip;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (batches_.empty() or not batches_.front()->sealed or
+          batches_.front()->pending) {
+        return;
+      }
+      batch = std::move(batches_.front());
+      batches_.pop_front();
+      skip = error_ != 0;
+    }
+    cv_.notify_all();
+
+    if (skip) {
+      continue;  // The callback already failed; drop the rest
+    }
+
+    batch->batch.data.resize(batch->used);
+    int result = callback_(batch->batch);
+    if (result) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (not error_) {
+          error_ = result;
+        }
+      }
+      cv_.notify_all();
+    }
+  }
+}
@@ -0,0 +1,96 @@
+#ifndef TESTSNAPSHOT_SMALL_FILE_READER_H_
+#define TESTSNAPSHOT_SMALL_FILE_READER_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "inode_refs.h"
+#include "thread_pool.h"
+
+struct SmallFileOptions {
+  size_t in_flight = 64;          // Files being opened, read or closed
+  size_t batch_bytes = 4 << 20;   // Size of each output buffer
+  uint64_t max_file_size = 64 << 10;
+};
+
+// One file in a batch; its content is data[offset, offset + size).
+struct PackedFile {
+  std::string path;
+  struct ceph_statx sb;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  int result = 0;  // Negative if the file could not be read
+};
+
+struct FileBatch {
+  std::vector<char> data;
+  std::vector<PackedFile> files;
+};
+
+// Receives each full batch, in the order the files were added. Called from
+// one thread at a time; a non-zero return stops the reader and is returned
+// from Add() and Finish().
+using BatchCallback = std::function<int(FileBatch& batch)>;
+
+// Reads many small files concurrently, each with a single read sized from
+// its stx_size, packing their contents back to back into large buffers so
+// the per-file open/read/close latency overlaps. Add() is thread safe and
+// blocks while `in_flight` files are outstanding.
+class SmallFileReader {
+ public:
+  SmallFileReader(std::shared_ptr<ceph_mount_info> mount,
+                  const SmallFileOptions& options, BatchCallback callback);
+  ~SmallFileReader();
+
+  SmallFileReader(const SmallFileReader&) = delete;
+  SmallFileReader& operator=(const SmallFileReader&) = delete;
+
+  const SmallFileOptions& options() const { return options_; }
+
+  // Queue the regular file `inode`, whose size is sb.stx_size; the inode
+  // stays pinned until it has been read.
+  int Add(const std::string& path, const struct ceph_statx& sb,
+          std::shared_ptr<Inode> inode);
+
+  // Deliver what is queued and wait for it.
+  int Finish();
+
+ private:
+  struct Batch {
+    FileBatch batch;
+    size_t used = 0;
+    size_t pending = 0;  // Files still being read
+    bool sealed = false;
+  };
+
+  void Read(std::shared_ptr<Batch> batch, size_t index,
+            std::shared_ptr<Inode> inode);
+  void Deliver();
+
+  const std::shared_ptr<ceph_mount_info> mount_;
+  const std::shared_ptr<InodeRefs> refs_;
+  const SmallFileOptions options_;
+  const BatchCallback callback_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::shared_ptr<Batch>> batches_;  // Oldest first
+  size_t in_flight_ = 0;
+  int error_ = 0;
+
+  std::mutex deliver_mutex_;  // Keeps callbacks in batch order
+
+  // Declared last so its threads are joined before anything they use goes
+  ThreadPool pool_;
+};
+
+#endif  // TESTSNAPSHOT_SMALL_FILE_READER_H_
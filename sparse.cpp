@@ -0,0 +1,221 @@
+#include "sparse.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "log.h"
+
+namespace {
+
+// Largest single read; a multiple of kSparseBlock
+constexpr size_t kReadChunk = 4 << 20;
+
+uint64_t AlignDown(uint64_t value) {
+  return value & ~static_cast<uint64_t>(kSparseBlock - 1);
+}
+
+uint64_t AlignUp(uint64_t value) { return AlignDown(value + kSparseBlock - 1); }
+
+// Read [start, end) and deliver its non-zero blocks. `start` is block
+// aligned; `end` is block aligned or the end of the file.
+int ReadRange(std::shared_ptr<ceph_mount_info> mount, Fh* fh, uint64_t start,
+              uint64_t end, std::vector<char>& buf,
+              const ExtentCallback& callback, SparseStats& stats) {
+  for (uint64_t pos = start; pos < end;) {
+    const size_t want = std::min<uint64_t>(kReadChunk, end - pos);
+    size_t got = 0;
+
+    while (got < want) {
+      int result = ceph_ll_read(mount.get(), fh, pos + got, want - got,
+                                buf.data() + got);
+      if (result < 0) {
+        LOG(kError) << "Failed to read at offset " << pos + got << ": error "
+                    << -result << " (" << ::strerror(-result) << ")";
+        return result;
+      }
+      if (result == 0) {
+        break;  // Shorter than the caller thought
+      }
+      got += result;
+    }
+
+    stats.read_bytes += got;
+
+    // Emit maximal runs of non-zero blocks
+    size_t run = 0;
+    size_t run_size = 0;
+    for (size_t block = 0; block < got; block += kSparseBlock) {
+      const size_t size = std::min(kSparseBlock, got - block);
+      if (IsZero(buf.data() + block, size)) {
+        if (run_size) {
+          stats.data_bytes += run_size;
+          int result = callback(pos + run, buf.data() + run, run_size);
+          if (result) {
+            return result;
+          }
+        }
+        run = block + size;
+        run_size = 0;
+      } else {
+        run_size += size;
+      }
+    }
+
+    if (run_size) {
+      stats.data_bytes += run_size;
+      int result = callback(pos + run, buf.data() + run, run_size);
+      if (result) {
+        return result;
+      }
+    }
+
+    if (got < want) {
+      break;
+    }
+    pos += got;
+  }
+
+  return 0;
+}
+
+}  // namespace
+
+bool IsZero(const char* data, size_t size) {
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  for (; i + 128 <= size; i += 128) {
+    const auto* p = reinterpret_cast<const __m256i*>(data + i);
+    const __m256i acc = _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+        _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+    if (not _mm256_testz_si256(acc, acc)) {
+      return false;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 64 <= size; i += 64) {
+    const auto* p = reinterpret_cast<const __m128i*>(data + i);
+    const __m128i acc = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+        _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+      return false;
+    }
+  }
+#endif
+
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    if (word) {
+      return false;
+    }
+  }
+
+  for (; i < size; ++i) {
+    if (data[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int ReadSparse(std::shared_ptr<ceph_mount_info> mount, Fh* fh, uint64_t size,
+               ExtentCallback callback, SparseStats* stats) {
+  SparseStats local;
+  SparseStats& s = stats ? *stats : local;
+  std::vector<char> buf(std::min<uint64_t>(kReadChunk, AlignUp(size)));
+  bool seek = true;
+
+  for (uint64_t offset = 0; offset < size;) {
+    uint64_t data = offset;
+    uint64_t hole = size;
+
+    if (seek) {
+      int64_t result = ceph_ll_lseek(mount.get(), fh, offset, SEEK_DATA);
+      if (result == -ENXIO) {
+        break;  // Nothing but hole up to the end
+      }
+
+      if (result < 0) {
+        // Fall back to zero detection over the whole file
+        seek = false;
+        s.seek_supported = false;
+      } else {
+        data = result;
+        result = ceph_ll_lseek(mount.get(), fh, data, SEEK_HOLE);
+        hole = result < 0 ? size : std::min<uint64_t>(size, result);
+      }
+    }
+
+    // Widen to whole blocks so that zero runs come out the same whether
+    // the client reported them as holes or not.
+    const uint64_t start = std::max(offset, AlignDown(data));
+    uint64_t end = std::min(size, AlignUp(hole));
+    if (start >= size) {
+      break;
+    }
+    if (end <= start) {
+      end = std::min(size, start + kSparseBlock);
+    }
+
+    int result = ReadRange(mount, fh, start, end, buf, callback, s);
+    if (result) {
+      return result;
+    }
+
+    offset = end;
+  }
+
+  return 0;
+}
+
+int CopySparse(std::shared_ptr<ceph_mount_info> mount, Fh* src, uint64_t size,
+               Fh* dst, Inode* dst_inode, SparseStats* stats,
+               const StripedWriterOptions& write_options,
+               WriteStats* write_stats) {
+  FileLayout layout;
+  if (GetFileLayout(mount, dst_inode, layout)) {
+    LOG(kWarn) << "Writing copy with the default layout";
+    layout = FileLayout();
+  }
+
+  StripedWriter writer(mount, dst, layout, write_options);
+
+  int result = ReadSparse(
+      mount, src, size,
+      [&writer](uint64_t offset, const char* data, size_t size) {
+        return writer.Write(offset, data, size);
+      },
+      stats);
+
+  const int finish_result = writer.Finish(write_stats);
+  if (result == 0) {
+    result = finish_result;
+  }
+  if (result) {
+    return result;
+  }
+
+  // Extends over a trailing hole, which was never written
+  result = ceph_ll_truncate(mount.get(), dst_inode, size,
+                            ceph_mount_perms(mount.get()));
+  if (result) {
+    LOG(kError) << "Failed to set size of copy to " << size << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+  }
+  return result;
+}
@@ -0,0 +1,48 @@
+#ifndef TESTSNAPSHOT_SPARSE_H_
+#define TESTSNAPSHOT_SPARSE_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "striped_writer.h"
+
+// Zero detection granularity. Blocks sit on multiples of this in the file.
+constexpr size_t kSparseBlock = 4096;
+
+// True if all `size` bytes are zero.
+bool IsZero(const char* data, size_t size);
+
+// Receives a run of data at absolute `offset`. Ranges never overlap and
+// arrive in increasing order; a long run may be split across calls. A
+// non-zero return stops the read and is returned from ReadSparse().
+using ExtentCallback =
+    std::function<int(uint64_t offset, const char* data, size_t size)>;
+
+struct SparseStats {
+  uint64_t data_bytes = 0;  // Bytes delivered to the callback
+  uint64_t read_bytes = 0;  // Bytes read from the cluster
+  bool seek_supported = true;
+};
+
+// Read the first `size` bytes of `fh`, skipping holes. Holes are found with
+// SEEK_DATA/SEEK_HOLE when the client supports them; otherwise, and within
+// data extents, all-zero blocks are dropped after reading. Whichever way a
+// range of zeros is found, the callback sees the same runs, so results
+// built from them (digests, copies) do not depend on how the file was
+// written.
+int ReadSparse(std::shared_ptr<ceph_mount_info> mount, Fh* fh, uint64_t size,
+               ExtentCallback callback, SparseStats* stats = nullptr);
+
+// Copy the first `size` bytes of `src` to `dst`, writing only data runs and
+// then truncating `dst_inode` to `size`, so holes stay holes. The runs are
+// written with a StripedWriter laid out like `dst_inode`.
+int CopySparse(std::shared_ptr<ceph_mount_info> mount, Fh* src, uint64_t size,
+               Fh* dst, Inode* dst_inode, SparseStats* stats = nullptr,
+               const StripedWriterOptions& write_options = {},
+               WriteStats* write_stats = nullptr);
+
+#endif  // TESTSNAPSHOT_SPARSE_H_
@@ -0,0 +1,250 @@
+#include "striped_writer.h"
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "client.h"
+#include "log.h"
+
+struct StripedWriter::Request {
+  struct ceph_ll_io_info io = {};
+  struct iovec iov = {};
+  std::vector<char> data;
+  uint64_t offset = 0;
+  StripedWriter* writer = nullptr;
+};
+
+namespace {
+
+int GetLayoutField(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+                   const std::string& field, uint64_t& value) {
+  std::string text;
+  int result = GetXattr(mount, inode, "ceph.file.layout." + field, text);
+  if (result) {
+    return result;
+  }
+
+  char* end = nullptr;
+  value = std::strtoull(text.c_str(), &end, 10);
+  return value == 0 or end == text.c_str() ? -EINVAL : 0;
+}
+
+}  // namespace
+
+int GetFileLayout(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+                  FileLayout& layout) {
+  int result = GetLayoutField(mount, inode, "stripe_unit", layout.stripe_unit);
+  if (result == 0) {
+    result = GetLayoutField(mount, inode, "stripe_count", layout.stripe_count);
+  }
+  if (result == 0) {
+    result = GetLayoutField(mount, inode, "object_size", layout.object_size);
+  }
+  if (result == 0 and layout.object_size % layout.stripe_unit) {
+    result = -EINVAL;  // The MDS never hands these out
+  }
+  if (result) {
+    LOG(kError) << "Failed to read file layout: error " << -result << " ("
+                << ::strerror(-result) << ")";
+  }
+  return result;
+}
+
+StripedWriter::StripedWriter(std::shared_ptr<ceph_mount_info> mount, Fh* fh,
+                             const FileLayout& layout,
+                             const StripedWriterOptions& options)
+    : mount_(mount),
+      fh_(fh),
+      layout_(layout),
+      options_(options),
+      start_(std::chrono::steady_clock::now()) {}
+
+StripedWriter::~StripedWriter() { Drain(); }
+
+uint64_t FileLayout::ObjectNumber(uint64_t offset) const {
+  const uint64_t block = offset / stripe_unit;
+  const uint64_t object_set = offset / (object_size * stripe_count);
+  return object_set * stripe_count + block % stripe_count;
+}
+
+uint64_t FileLayout::ObjectExtentEnd(uint64_t offset) const {
+  // Without striping an object holds a contiguous range of the file;
+  // otherwise the next stripe unit is in the next object of the set
+  const uint64_t unit = stripe_count == 1 ? object_size : stripe_unit;
+  return (offset / unit + 1) * unit;
+}
+
+int StripedWriter::Write(uint64_t offset, const char* data, size_t size) {
+  while (size) {
+    if (current_ and
+        current_->offset + current_->data.size() != offset) {
+      int result = Issue();  // Not contiguous
+      if (result) {
+        return result;
+      }
+    }
+
+    const uint64_t extent_end = layout_.ObjectExtentEnd(offset);
+
+    if (not current_) {
+      current_ = std::make_unique<Request>();
+      current_->data.reserve(std::min<uint64_t>(extent_end - offset, size));
+      current_->offset = offset;
+    }
+
+    const size_t take = std::min<uint64_t>(size, extent_end - offset);
+    current_->data.insert(current_->data.end(), data, data + take);
+
+    offset += take;
+    data += take;
+    size -= take;
+
+    if (offset == extent_end) {
+      int result = Issue();
+      if (result) {
+        return result;
+      }
+    }
+  }
+  return 0;
+}
+
+int StripedWriter::Finish(WriteStats* stats) {
+  int result = current_ ? Issue() : 0;
+
+  const int drain_result = Drain();
+  if (result == 0) {
+    result = drain_result;
+  }
+
+  if (result == 0 and options_.fsync != FsyncPolicy::kNone and unsynced_) {
+    result = Sync();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.elapsed = std::chrono::steady_clock::now() - start_;
+  if (stats) {
+    *stats = stats_;
+  }
+  return result;
+}
+
+int StripedWriter::Issue() {
+  std::unique_ptr<Request> request = std::move(current_);
+  const size_t size = request->data.size();
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock,
+             [this] { return error_ or in_flight_ < options_.in_flight; });
+    if (error_) {
+      return error_;
+    }
+    ++in_flight_;
+    ++stats_.requests;
+  }
+
+  request->writer = this;
+  request->iov.iov_base = request->data.data();
+  request->iov.iov_len = size;
+  request->io.callback = Complete;
+  request->io.priv = request.get();
+  request->io.fh = fh_;
+  request->io.iov = &request->iov;
+  request->io.iovcnt = 1;
+  request->io.off = request->offset;
+  request->io.write = true;
+
+  // On success the callback owns the request, and may already have run
+  Request* pending = request.release();
+  const int64_t result =
+      ceph_ll_nonblocking_readv_writev(mount_.get(), &pending->io);
+  if (result < 0) {
+    LOG(kError) << "Failed to write at offset " << pending->offset
+                << " (object " << layout_.ObjectNumber(pending->offset)
+                << "): error " << -result << " (" << ::strerror(-result)
+                << ")";
+    delete pending;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    --in_flight_;
+    if (not error_) {
+      error_ = result;
+    }
+    return result;
+  }
+
+  unsynced_ += size;
+  if (options_.fsync == FsyncPolicy::kInterval and
+      unsynced_ >= options_.fsync_bytes) {
+    return Sync();
+  }
+  return 0;
+}
+
+void StripedWriter::Complete(struct ceph_ll_io_info* io) {
+  // Runs on a libcephfs thread, so it must not call back into the client
+  std::unique_ptr<Request> request(static_cast<Request*>(io->priv));
+  StripedWriter* writer = request->writer;
+
+  std::lock_guard<std::mutex> lock(writer->mutex_);
+  if (io->result < 0 or
+      static_cast<uint64_t>(io->result) != request->data.size()) {
+    const int result = io->result < 0 ? io->result : -EIO;
+    LOG(kError) << "Failed to write " << request->data.size()
+                << " bytes at offset " << request->offset << " (object "
+                << writer->layout_.ObjectNumber(request->offset)
+                << "): error " << -result << " (" << ::strerror(-result)
+                << ")";
+    if (not writer->error_) {
+      writer->error_ = result;
+    }
+  } else {
+    writer->stats_.bytes += io->result;
+  }
+  --writer->in_flight_;
+  writer->cv_.notify_all();
+}
+
+int StripedWriter::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return in_flight_ == 0; });
+  return error_;
+}
+
+int StripedWriter::Sync() {
+  int result = Drain();
+  if (result) {
+    return result;
+  }
+
+  result = ceph_ll_fsync(mount_.get(), fh_, 1);
+  if (result) {
+    LOG(kError) << "Failed to fsync: error " << -result << " ("
+                << ::strerror(-result) << ")";
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not error_) {
+      error_ = result;
+    }
+    return result;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.fsyncs;
+  unsynced_ = 0;
+  return 0;
+}
+
+void LogWriteStats(const std::string& what, const WriteStats& stats) {
+  const double seconds =
+      std::chrono::duration<double>(stats.elapsed).count();
+  LOG(kInfo) << "Wrote " << what << ": " << stats.bytes << " bytes in "
+             << stats.requests << " requests and " << stats.fsyncs
+             << " fsyncs, " << seconds << "s, "
+             << (seconds > 0 ? stats.bytes / seconds / (1 << 20) : 0.0)
+             << " MiB/s";
+}
@@ -0,0 +1,100 @@
+#ifndef TESTSNAPSHOT_STRIPED_WRITER_H_
+#define TESTSNAPSHOT_STRIPED_WRITER_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// How a file's data is striped over RADOS objects.
+struct FileLayout {
+  uint64_t stripe_unit = 4 << 20;
+  uint64_t stripe_count = 1;
+  uint64_t object_size = 4 << 20;  // A multiple of stripe_unit
+
+  // Index of the object holding file offset `offset`.
+  uint64_t ObjectNumber(uint64_t offset) const;
+
+  // End of the range from `offset` that is contiguous in the same object.
+  uint64_t ObjectExtentEnd(uint64_t offset) const;
+};
+
+// Read the layout of `inode` from its ceph.file.layout.* xattrs.
+int GetFileLayout(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+                  FileLayout& layout);
+
+enum class FsyncPolicy {
+  kNone,      // Leave flushing to the client
+  kFinish,    // One fsync once everything is written
+  kInterval,  // Also every `fsync_bytes`
+};
+
+struct StripedWriterOptions {
+  size_t in_flight = 16;  // Write requests outstanding at once
+  FsyncPolicy fsync = FsyncPolicy::kFinish;
+  uint64_t fsync_bytes = 256 << 20;
+};
+
+struct WriteStats {
+  uint64_t bytes = 0;
+  uint64_t requests = 0;
+  uint64_t fsyncs = 0;
+  std::chrono::steady_clock::duration elapsed{};
+};
+
+// Writes a file as nonblocking requests, each covering the contiguous
+// range of one object: a whole object without striping, otherwise a
+// stripe unit. Consecutive requests then land in different objects (the
+// `stripe_count` objects of a set take turns), and with `in_flight` of
+// them outstanding one large file is written to many OSDs at once.
+// Contiguous writes are coalesced up to the end of their object's range.
+// Not thread safe.
+class StripedWriter {
+ public:
+  StripedWriter(std::shared_ptr<ceph_mount_info> mount, Fh* fh,
+                const FileLayout& layout, const StripedWriterOptions& options);
+  ~StripedWriter();
+
+  StripedWriter(const StripedWriter&) = delete;
+  StripedWriter& operator=(const StripedWriter&) = delete;
+
+  // Queue `size` bytes at `offset`; `data` is copied.
+  int Write(uint64_t offset, const char* data, size_t size);
+
+  // Wait for every write, then fsync as the policy asks.
+  int Finish(WriteStats* stats = nullptr);
+
+ private:
+  struct Request;
+
+  static void Complete(struct ceph_ll_io_info* io);
+
+  int Issue();
+  int Drain();
+  int Sync();
+
+  const std::shared_ptr<ceph_mount_info> mount_;
+  Fh* const fh_;
+  const FileLayout layout_;
+  const StripedWriterOptions options_;
+  const std::chrono::steady_clock::time_point start_;
+
+  std::unique_ptr<Request> current_;  // Being filled
+  uint64_t unsynced_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t in_flight_ = 0;
+  int error_ = 0;
+  WriteStats stats_;
+};
+
+// Log the throughput of a finished write.
+void LogWriteStats(const std::string& what, const WriteStats& stats);
+
+#endif  // TESTSNAPSHOT_STRIPED_WRITER_H_
@@ -0,0 +1,242 @@
+// Stops a checkpointed walk part way through directories, resumes it until
+// it completes, and checks that every entry was delivered exactly once.
+//
+// Runs against the cluster in /etc/ceph/ceph.conf. The tree is created
+// below the directory given as the first argument, the mount root by
+// default, and removed afterwards.
+
+#include <cephfs/libcephfs.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "client.h"
+#include "inode_refs.h"
+#include "log.h"
+#include "walker.h"
+
+namespace {
+
+// More entries per directory than the walker reads between publishing
+// its offset, so stops land both before and after a flush
+constexpr int kFilesPerDir = 300;
+constexpr int kDirs = 3;
+constexpr int kSubDirs = 3;
+constexpr uint64_t kEntriesPerRun = 500;
+
+struct Entry {
+  std::string path;
+  bool dir;
+};
+
+int MakeDir(std::shared_ptr<ceph_mount_info> mount, Inode* parent,
+            const std::string& name, std::shared_ptr<Inode>& dir) {
+  Inode* inode = nullptr;
+  struct ceph_statx sb;
+
+  int result = ceph_ll_mkdir(mount.get(), parent, name.c_str(), 0755, &inode,
+                             &sb, CEPH_STATX_ALL_STATS, 0,
+                             ceph_mount_perms(mount.get()));
+  if (result) {
+    LOG(kError) << "Failed to create directory " << name << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+  dir = ScopeInode(mount, inode, sb);
+  return 0;
+}
+
+int MakeFile(std::shared_ptr<ceph_mount_info> mount, Inode* parent,
+             const std::string& name) {
+  Inode* inode = nullptr;
+  Fh* fh = nullptr;
+  struct ceph_statx sb;
+
+  int result = ceph_ll_create(mount.get(), parent, name.c_str(), 0644,
+                              O_CREAT | O_WRONLY, &inode, &fh, &sb,
+                              CEPH_STATX_ALL_STATS, 0,
+                              ceph_mount_perms(mount.get()));
+  if (result) {
+    LOG(kError) << "Failed to create file " << name << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+  ScopeInode(mount, inode, sb);
+  return ceph_ll_close(mount.get(), fh);
+}
+
+int MakeFiles(std::shared_ptr<ceph_mount_info> mount, Inode* dir,
+              const std::string& path, std::vector<Entry>& entries) {
+  for (int i = 0; i < kFilesPerDir; ++i) {
+    const std::string name = "f" + std::to_string(i);
+    int result = MakeFile(mount, dir, name);
+    if (result) {
+      return result;
+    }
+    entries.push_back({path + "/" + name, false});
+  }
+  return 0;
+}
+
+int MakeTree(std::shared_ptr<ceph_mount_info> mount, Inode* root,
+             std::vector<Entry>& entries) {
+  for (int d = 0; d < kDirs; ++d) {
+    const std::string name = "d" + std::to_string(d);
+    std::shared_ptr<Inode> dir;
+
+    int result = MakeDir(mount, root, name, dir);
+    if (result) {
+      return result;
+    }
+    entries.push_back({name, true});
+
+    result = MakeFiles(mount, dir.get(), name, entries);
+    if (result) {
+      return result;
+    }
+
+    for (int s = 0; s < kSubDirs; ++s) {
+      const std::string sub_name = "s" + std::to_string(s);
+      std::shared_ptr<Inode> sub_dir;
+
+      result = MakeDir(mount, dir.get(), sub_name, sub_dir);
+      if (result) {
+        return result;
+      }
+      entries.push_back({name + "/" + sub_name, true});
+
+      result = MakeFiles(mount, sub_dir.get(), name + "/" + sub_name,
+                         entries);
+      if (result) {
+        return result;
+      }
+    }
+  }
+  return 0;
+}
+
+// Remove `entries` below `tree`, deepest first.
+void RemoveTree(std::shared_ptr<ceph_mount_info> mount,
+                const std::string& tree, const std::vector<Entry>& entries) {
+  for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry) {
+    const std::string path = tree + "/" + entry->path;
+    if (entry->dir) {
+      ceph_rmdir(mount.get(), path.c_str());
+    } else {
+      ceph_unlink(mount.get(), path.c_str());
+    }
+  }
+  ceph_rmdir(mount.get(), tree.c_str());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const std::string parent = argc > 1 ? argv[1] : "";
+  const std::string name =
+      "testsnapshot-walk-resume-" + std::to_string(::getpid());
+  const std::string tree = parent.empty() ? name : parent + "/" + name;
+  const std::string checkpoint = "/tmp/" + name + ".walk";
+
+  std::shared_ptr<ceph_mount_info> mount;
+  std::shared_ptr<UserPerm> user_perms;
+
+  int result = Mount(mount, user_perms);
+  if (result) {
+    LOG(kError) << "Failed to mount ceph: error " << -result << " ("
+                << ::strerror(-result) << ")";
+    return 1;
+  }
+
+  std::shared_ptr<Inode> parent_inode;
+  struct ceph_statx sb;
+
+  result = WalkPath(mount, parent.empty() ? "/" : parent, parent_inode, sb);
+  if (result) {
+    return 1;
+  }
+
+  std::shared_ptr<Inode> root;
+  std::vector<Entry> entries;
+
+  result = MakeDir(mount, parent_inode.get(), name, root);
+  if (result == 0) {
+    result = MakeTree(mount, root.get(), entries);
+  }
+
+  std::map<std::string, int> delivered;
+  size_t runs = 0;
+
+  if (result == 0) {
+    result = WalkPath(mount, tree, root, sb);
+  }
+
+  const vinodeno_t root_vino = {{sb.stx_ino}, {sb.stx_dev}};
+
+  WalkOptions options;
+  options.threads = 4;
+  options.checkpoint_path = checkpoint;
+  // Only the checkpoint saved when a run stops is used
+  options.checkpoint_interval = std::chrono::hours(1);
+
+  while (result == 0 or result == -ECANCELED) {
+    std::mutex mutex;
+    uint64_t accepted = 0;
+
+    ++runs;
+    result = WalkTree(mount, root_vino, options,
+                      [&](const std::string& path, const struct ceph_statx&,
+                          std::shared_ptr<Inode>) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (accepted == kEntriesPerRun) {
+                          return false;
+                        }
+                        ++accepted;
+                        ++delivered[path];
+                        return true;
+                      });
+    if (result == 0) {
+      break;
+    }
+  }
+
+  RemoveTree(mount, tree, entries);
+  ::unlink(checkpoint.c_str());
+
+  if (result) {
+    LOG(kError) << "Walk failed: error " << -result << " ("
+                << ::strerror(-result) << ")";
+    FlushLog();
+    return 1;
+  }
+
+  size_t failures = 0;
+  for (const auto& entry : entries) {
+    auto it = delivered.find(entry.path);
+    const int count = it == delivered.end() ? 0 : it->second;
+    if (count != 1) {
+      LOG(kError) << entry.path << " delivered " << count << " times";
+      ++failures;
+    }
+    if (it != delivered.end()) {
+      delivered.erase(it);
+    }
+  }
+  for (const auto& extra : delivered) {
+    LOG(kError) << extra.first << " delivered but never created";
+    ++failures;
+  }
+
+  LOG(kInfo) << entries.size() << " entries walked in " << runs << " runs, "
+             << failures << " failures";
+  FlushLog();
+  return failures ? 1 : 0;
+}
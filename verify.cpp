@@ -0,0 +1,599 @@
+#include "verify.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "client.h"
+#include "digest.h"
+#include "inode_refs.h"
+#include "log.h"
+#include "thread_pool.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Xattrs = std::vector<std::pair<std::string, std::string>>;
+
+const char* TypeName(uint16_t mode) {
+  if (S_ISDIR(mode)) {
+    return "directory";
+  }
+  if (S_ISREG(mode)) {
+    return "file";
+  }
+  if (S_ISLNK(mode)) {
+    return "symlink";
+  }
+  return "special";
+}
+
+std::string Octal(uint32_t mode) {
+  char buf[16];
+  std::snprintf(buf, sizeof(buf), "%o", mode);
+  return buf;
+}
+
+std::string Time(const struct timespec& time) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%lld.%09ld",
+                static_cast<long long>(time.tv_sec), time.tv_nsec);
+  return buf;
+}
+
+// Xattr values and link targets end up in log lines
+std::string Printable(const std::string& value) {
+  constexpr size_t kMaxLength = 64;
+
+  std::string printable;
+  for (size_t i = 0; i < value.size() and i < kMaxLength; ++i) {
+    const unsigned char c = value[i];
+    printable += std::isprint(c) ? static_cast<char>(c) : '?';
+  }
+  if (value.size() > kMaxLength) {
+    printable += "...";
+  }
+  return printable;
+}
+
+std::string Join(const std::string& path, const std::string& name) {
+  return path.empty() ? name : path + "/" + name;
+}
+
+int ReadLink(std::shared_ptr<ceph_mount_info> mount, Inode* inode,
+             const struct ceph_statx& sb, std::string& link) {
+  link.assign(sb.stx_size ? sb.stx_size : PATH_MAX, '\0');
+
+  int result = ceph_ll_readlink(mount.get(), inode, link.data(), link.size(),
+                                ceph_mount_perms(mount.get()));
+  if (result < 0) {
+    return result;
+  }
+  link.resize(result);
+  return 0;
+}
+
+// A snapshot directory being read by the walk, with its live counterpart
+struct Directory {
+  std::string path;
+  std::shared_ptr<Inode> snapshot;
+  std::shared_ptr<Inode> live;  // Null when the live tree has none there
+  bool whole = false;  // Read from its first entry, so `names` lists it all
+  std::vector<std::string> names;  // Of the entries delivered so far
+  size_t in_flight = 0;            // Compares queued, under Verifier::mutex_
+};
+
+class Verifier {
+ public:
+  Verifier(std::shared_ptr<ceph_mount_info> mount,
+           const std::string& live_path, const VerifyOptions& options,
+           MismatchCallback callback)
+      : mount_(mount),
+        refs_(GetInodeRefs(mount.get())),
+        live_path_(live_path),
+        options_(options),
+        callback_(std::move(callback)),
+        pool_(std::max<size_t>(1, options.threads)) {}
+
+  int Run(const std::string& snapshot_path, VerifyStats* stats);
+
+ private:
+  int OpenDirectory(const std::string& path, std::shared_ptr<Inode> inode,
+                    int64_t offset, WalkDir& visit);
+  int FindLive(const std::string& path, std::shared_ptr<Inode>& live,
+               struct ceph_statx& live_sb);
+
+  // `parent` is null for the roots
+  bool Queue(std::shared_ptr<Directory> parent, const std::string& path,
+             const struct ceph_statx& sb, std::shared_ptr<Inode> inode);
+  void Compare(Directory* parent, const std::string& path,
+               const struct ceph_statx& sb, std::shared_ptr<Inode> inode);
+
+  int CompareEntry(const Directory* parent, const std::string& path,
+                   const struct ceph_statx& sb, std::shared_ptr<Inode> inode);
+  void CompareAttributes(const std::string& path,
+                         const struct ceph_statx& snapshot,
+                         const struct ceph_statx& live);
+  int CompareXattrs(const std::string& path, Inode* snapshot, Inode* live);
+  int CompareContent(const std::string& path, const struct ceph_statx& sb,
+                     Inode* snapshot, Inode* live);
+  int CompareLinks(const std::string& path, const struct ceph_statx& sb,
+                   Inode* snapshot, const struct ceph_statx& live_sb,
+                   Inode* live);
+  int CompareListings(Directory& dir);
+
+  // The findings, kept in the walk's checkpoint so that a resumed run
+  // still fails for those of the runs before it
+  std::string SaveState() const;
+  int LoadState(const std::string& state);
+
+  void Report(const std::string& path, const std::string& what,
+              const std::string& snapshot, const std::string& live);
+
+  const std::shared_ptr<ceph_mount_info> mount_;
+  const std::shared_ptr<InodeRefs> refs_;
+  const std::string live_path_;
+  const VerifyOptions options_;
+  const MismatchCallback callback_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t in_flight_ = 0;
+  int error_ = 0;
+
+  std::atomic<bool> timed_out_{false};
+  std::atomic<uint64_t> entries_{0};
+  std::atomic<uint64_t> digested_bytes_{0};
+  std::atomic<uint64_t> mismatches_{0};
+  std::atomic<uint64_t> errors_{0};
+
+  ThreadPool pool_;  // Last, so its threads are joined first
+};
+
+int Verifier::Run(const std::string& snapshot_path, VerifyStats* stats) {
+  std::shared_ptr<Inode> root;
+  struct ceph_statx sb;
+
+  int result = WalkPath(mount_, snapshot_path, root, sb);
+  if (result) {
+    return result;
+  }
+
+  if (not S_ISDIR(sb.stx_mode)) {
+    LOG(kError) << "Snapshot path " << snapshot_path
+                << " is not a directory";
+    return -ENOTDIR;
+  }
+
+  const vinodeno_t root_vino = {{sb.stx_ino}, {sb.stx_dev}};
+
+  Queue(nullptr, "", sb, std::move(root));
+
+  WalkHooks hooks;
+  hooks.dir = [this](const std::string& path, std::shared_ptr<Inode> inode,
+                     int64_t offset, WalkDir& visit) {
+    return OpenDirectory(path, std::move(inode), offset, visit);
+  };
+  hooks.save_state = [this] { return SaveState(); };
+  hooks.load_state = [this](const std::string& state) {
+    return LoadState(state);
+  };
+
+  result = WalkTree(mount_, root_vino, options_.walk, std::move(hooks));
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return in_flight_ == 0; });
+
+  if (stats) {
+    stats->entries = entries_;
+    stats->digested_bytes = digested_bytes_;
+    stats->mismatches = mismatches_;
+    stats->errors = errors_;
+  }
+
+  if (result == -ECANCELED and timed_out_) {
+    return -ETIMEDOUT;
+  }
+  if (result == 0) {
+    result = error_;
+  }
+  // Entries an earlier run could not compare
+  if (result == 0 and errors_) {
+    result = -EIO;
+  }
+  if (result == 0 and mismatches_) {
+    result = -EBADMSG;
+  }
+  return result;
+}
+
+int Verifier::OpenDirectory(const std::string& path,
+                            std::shared_ptr<Inode> inode, int64_t offset,
+                            WalkDir& visit) {
+  auto dir = std::make_shared<Directory>();
+  dir->path = path;
+  dir->snapshot = std::move(inode);
+  dir->whole = offset == 0;
+
+  // Once per directory; its entries are then looked up by name in it
+  struct ceph_statx live_sb;
+  int result = FindLive(path, dir->live, live_sb);
+  if (result) {
+    return result;
+  }
+  if (dir->live and not S_ISDIR(live_sb.stx_mode)) {
+    // Reported as a type mismatch; every entry below is missing
+    dir->live.reset();
+  }
+
+  visit.entry = [this, dir](const std::string& path,
+                            const struct ceph_statx& sb,
+                            std::shared_ptr<Inode> inode) {
+    if (not Queue(dir, path, sb, std::move(inode))) {
+      return false;
+    }
+    if (dir->whole) {
+      dir->names.push_back(
+          path.substr(dir->path.empty() ? 0 : dir->path.size() + 1));
+    }
+    return true;
+  };
+  visit.sync = [this, dir] {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&dir] { return dir->in_flight == 0; });
+  };
+  visit.finish = [this, dir] { return CompareListings(*dir); };
+  return 0;
+}
+
+// `live` is left null when there is no entry at `path` below the live root.
+int Verifier::FindLive(const std::string& path, std::shared_ptr<Inode>& live,
+                       struct ceph_statx& live_sb) {
+  const std::string live_path = Join(live_path_, path);
+  Inode* live_inode = nullptr;
+
+  // The entry itself, not what a symbolic link points to
+  int result = ceph_ll_walk(mount_.get(), live_path.c_str(), &live_inode,
+                            &live_sb, CEPH_STATX_ALL_STATS,
+                            AT_SYMLINK_NOFOLLOW,
+                            ceph_mount_perms(mount_.get()));
+  if (result == -ENOENT or result == -ENOTDIR) {
+    live.reset();
+    return 0;
+  }
+  if (result) {
+    LOG(kError) << "Failed to walk ceph path " << live_path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  live = ScopeInode(mount_, refs_, live_inode, live_sb);
+  return 0;
+}
+
+bool Verifier::Queue(std::shared_ptr<Directory> parent,
+                     const std::string& path, const struct ceph_statx& sb,
+                     std::shared_ptr<Inode> inode) {
+  if (Clock::now() >= options_.deadline) {
+    timed_out_ = true;
+    return false;
+  }
+
+  {
+    // Queued snapshot inodes stay pinned, so keep the queue short
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return in_flight_ < pool_.size(); });
+    ++in_flight_;
+    if (parent) {
+      ++parent->in_flight;
+    }
+  }
+
+  pool_.Post([this, parent, path, sb, inode] {
+    Compare(parent.get(), path, sb, inode);
+  });
+  return true;
+}
+
+void Verifier::Compare(Directory* parent, const std::string& path,
+                       const struct ceph_statx& sb,
+                       std::shared_ptr<Inode> inode) {
+  ++entries_;
+
+  const int result = CompareEntry(parent, path, sb, std::move(inode));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (result) {
+    ++errors_;
+    if (not error_) {
+      error_ = result;
+    }
+  }
+  --in_flight_;
+  if (parent) {
+    --parent->in_flight;
+  }
+  cv_.notify_all();
+}
+
+int Verifier::CompareEntry(const Directory* parent, const std::string& path,
+                           const struct ceph_statx& sb,
+                           std::shared_ptr<Inode> inode) {
+  struct ceph_statx live_sb;
+  std::shared_ptr<Inode> live;
+  int result = 0;
+
+  if (not parent) {
+    result = FindLive(path, live, live_sb);
+  } else if (parent->live) {
+    const std::string name =
+        path.substr(parent->path.empty() ? 0 : parent->path.size() + 1);
+    Inode* live_inode = nullptr;
+
+    result = ceph_ll_lookup(mount_.get(), parent->live.get(), name.c_str(),
+                            &live_inode, &live_sb, CEPH_STATX_ALL_STATS, 0,
+                            ceph_mount_perms(mount_.get()));
+    if (result == 0) {
+      live = ScopeInode(mount_, refs_, live_inode, live_sb);
+    } else if (result == -ENOENT) {
+      result = 0;
+    } else {
+      LOG(kError) << "Failed to lookup " << name << " in live directory "
+                  << Join(live_path_, parent->path) << ": error " << -result
+                  << " (" << ::strerror(-result) << ")";
+    }
+  }
+  if (result) {
+    return result;
+  }
+
+  if (not live) {
+    Report(path, "entry", TypeName(sb.stx_mode), "-");
+    return 0;
+  }
+
+  if ((sb.stx_mode & S_IFMT) != (live_sb.stx_mode & S_IFMT)) {
+    Report(path, "type", TypeName(sb.stx_mode), TypeName(live_sb.stx_mode));
+    return 0;
+  }
+
+  CompareAttributes(path, sb, live_sb);
+
+  result = CompareXattrs(path, inode.get(), live.get());
+  if (result) {
+    return result;
+  }
+
+  if (S_ISREG(sb.stx_mode)) {
+    return CompareContent(path, sb, inode.get(), live.get());
+  }
+  if (S_ISLNK(sb.stx_mode)) {
+    return CompareLinks(path, sb, inode.get(), live_sb, live.get());
+  }
+  return 0;
+}
+
+void Verifier::CompareAttributes(const std::string& path,
+                                 const struct ceph_statx& snapshot,
+                                 const struct ceph_statx& live) {
+  if ((snapshot.stx_mode & 07777) != (live.stx_mode & 07777)) {
+    Report(path, "mode", Octal(snapshot.stx_mode & 07777),
+           Octal(live.stx_mode & 07777));
+  }
+  if (snapshot.stx_uid != live.stx_uid) {
+    Report(path, "uid", std::to_string(snapshot.stx_uid),
+           std::to_string(live.stx_uid));
+  }
+  if (snapshot.stx_gid != live.stx_gid) {
+    Report(path, "gid", std::to_string(snapshot.stx_gid),
+           std::to_string(live.stx_gid));
+  }
+  // A snapshot inode keeps the number of the live inode it was taken of,
+  // so a different number means the entry was replaced
+  if (snapshot.stx_ino != live.stx_ino) {
+    Report(path, "ino", std::to_string(snapshot.stx_ino),
+           std::to_string(live.stx_ino));
+  }
+  // Directory sizes are recursive statistics the MDS updates lazily; their
+  // listings are compared instead
+  if (not S_ISDIR(snapshot.stx_mode) and snapshot.stx_size != live.stx_size) {
+    Report(path, "size", std::to_string(snapshot.stx_size),
+           std::to_string(live.stx_size));
+  }
+  if (snapshot.stx_mtime.tv_sec != live.stx_mtime.tv_sec or
+      snapshot.stx_mtime.tv_nsec != live.stx_mtime.tv_nsec) {
+    Report(path, "mtime", Time(snapshot.stx_mtime), Time(live.stx_mtime));
+  }
+}
+
+int Verifier::CompareXattrs(const std::string& path, Inode* snapshot,
+                            Inode* live) {
+  Xattrs snapshot_xattrs;
+  Xattrs live_xattrs;
+
+  int result = GetXattrs(mount_, snapshot, snapshot_xattrs);
+  if (result == 0) {
+    result = GetXattrs(mount_, live, live_xattrs);
+  }
+  if (result) {
+    LOG(kError) << "Failed to read xattrs of " << path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  // Both are sorted by name
+  auto s = snapshot_xattrs.begin();
+  auto l = live_xattrs.begin();
+
+  while (s != snapshot_xattrs.end() or l != live_xattrs.end()) {
+    if (l == live_xattrs.end() or
+        (s != snapshot_xattrs.end() and s->first < l->first)) {
+      Report(path, "xattr " + s->first, Printable(s->second), "-");
+      ++s;
+    } else if (s == snapshot_xattrs.end() or l->first < s->first) {
+      Report(path, "xattr " + l->first, "-", Printable(l->second));
+      ++l;
+    } else {
+      if (s->second != l->second) {
+        Report(path, "xattr " + s->first, Printable(s->second),
+               Printable(l->second));
+      }
+      ++s;
+      ++l;
+    }
+  }
+  return 0;
+}
+
+int Verifier::CompareContent(const std::string& path,
+                             const struct ceph_statx& sb, Inode* snapshot,
+                             Inode* live) {
+  if (not options_.digest) {
+    return 0;
+  }
+
+  uint64_t snapshot_digest = 0;
+  uint64_t live_digest = 0;
+
+  int result = DigestFile(mount_, snapshot, snapshot_digest);
+  if (result == 0) {
+    result = DigestFile(mount_, live, live_digest);
+  }
+  if (result) {
+    LOG(kError) << "Failed to digest " << path << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  digested_bytes_ += sb.stx_size;
+
+  if (snapshot_digest != live_digest) {
+    Report(path, "content", Digest::Hex(snapshot_digest),
+           Digest::Hex(live_digest));
+  }
+  return 0;
+}
+
+int Verifier::CompareLinks(const std::string& path,
+                           const struct ceph_statx& sb, Inode* snapshot,
+                           const struct ceph_statx& live_sb, Inode* live) {
+  std::string snapshot_link;
+  std::string live_link;
+
+  int result = ReadLink(mount_, snapshot, sb, snapshot_link);
+  if (result == 0) {
+    result = ReadLink(mount_, live, live_sb, live_link);
+  }
+  if (result) {
+    LOG(kError) << "Failed to read link " << path << ": error " << -result
+                << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  if (snapshot_link != live_link) {
+    Report(path, "link", Printable(snapshot_link), Printable(live_link));
+  }
+  return 0;
+}
+
+// Entries missing from the live tree are found by the walk of the
+// snapshot; this finds the ones only the live tree has.
+int Verifier::CompareListings(Directory& dir) {
+  if (not dir.live) {
+    return 0;
+  }
+
+  std::vector<std::string> names = std::move(dir.names);
+
+  if (not dir.whole) {
+    // Resumed part way through, so the names delivered are not all of them
+    names.clear();
+    int result = ReadDir(mount_, dir.snapshot,
+                         [&names](const std::string& name,
+                                  const struct ceph_statx&,
+                                  std::shared_ptr<Inode>) {
+                           if (name != "." and name != "..") {
+                             names.push_back(name);
+                           }
+                           return true;
+                         });
+    if (result < 0) {
+      return result;
+    }
+  }
+
+  std::sort(names.begin(), names.end());
+
+  int result = ReadDir(mount_, dir.live,
+                       [&](const std::string& name,
+                           const struct ceph_statx& sb,
+                           std::shared_ptr<Inode>) {
+                         if (name != "." and name != ".." and
+                             not std::binary_search(names.begin(),
+                                                    names.end(), name)) {
+                           Report(Join(dir.path, name), "entry", "-",
+                                  TypeName(sb.stx_mode));
+                         }
+                         return true;
+                       });
+  return result < 0 ? result : 0;
+}
+
+std::string Verifier::SaveState() const {
+  const uint64_t counts[] = {mismatches_.load(), errors_.load()};
+  return std::string(reinterpret_cast<const char*>(counts), sizeof(counts));
+}
+
+int Verifier::LoadState(const std::string& state) {
+  uint64_t counts[2];
+  if (state.size() != sizeof(counts)) {
+    LOG(kError) << "Invalid verification state in checkpoint "
+                << options_.walk.checkpoint_path;
+    return -EINVAL;
+  }
+  std::memcpy(counts, state.data(), sizeof(counts));
+
+  if (counts[0] or counts[1]) {
+    LOG(kWarn) << "Earlier runs of this verification found " << counts[0]
+               << " mismatches and " << counts[1]
+               << " entries that could not be compared";
+  }
+  mismatches_ += counts[0];
+  errors_ += counts[1];
+  return 0;
+}
+
+void Verifier::Report(const std::string& path, const std::string& what,
+                      const std::string& snapshot, const std::string& live) {
+  ++mismatches_;
+  callback_({path.empty() ? "." : path, what, snapshot, live});
+}
+
+}  // namespace
+
+int VerifyTree(std::shared_ptr<ceph_mount_info> mount,
+               const std::string& snapshot_path, const std::string& live_path,
+               const VerifyOptions& options, MismatchCallback callback,
+               VerifyStats* stats) {
+  Verifier verifier(mount, live_path, options, std::move(callback));
+  return verifier.Run(snapshot_path, stats);
+}
+
+void LogMismatch(const std::string& what, const Mismatch& mismatch) {
+  // Every mismatch is a finding, so none may be rate limited away
+  LOG_UNLIMITED(kError) << what << ": mismatch " << mismatch.path << ": "
+                        << mismatch.what << " is " << mismatch.snapshot
+                        << " in the snapshot, " << mismatch.live
+                        << " in the live tree";
+}
@@ -0,0 +1,69 @@
+#ifndef TESTSNAPSHOT_VERIFY_H_
+#define TESTSNAPSHOT_VERIFY_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "walker.h"
+
+// Snapshot verification.
+//
+// The snapshot is walked with WalkTree(). For every snapshot directory the
+// live directory at the same path is looked up once, and each entry is
+// handed to a pool of compare threads, which look it up by name in that
+// live directory and compare type, mode, owner, inode number, size, mtime,
+// xattrs, link targets and, for regular files, content digests. Once a
+// directory is read, its live listing is checked for names the snapshot
+// does not have. A snapshot taken of a quiesced tree matches it exactly.
+//
+// With a walk checkpoint, a directory's offset only moves past entries
+// whose compares have finished, and the findings so far are kept in the
+// checkpoint: a resumed verification fails if any run of it found a
+// mismatch.
+
+struct VerifyOptions {
+  WalkOptions walk;     // Walk of the snapshot
+  size_t threads = 16;  // Entries compared at once
+  bool digest = true;   // Compare the content of regular files
+  // The walk stops with -ETIMEDOUT once this passes
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::time_point::max();
+};
+
+struct VerifyStats {
+  uint64_t entries = 0;
+  uint64_t digested_bytes = 0;  // Per side
+  // Both include those of the runs a resumed verification follows
+  uint64_t mismatches = 0;
+  uint64_t errors = 0;  // Entries that could not be compared
+};
+
+struct Mismatch {
+  std::string path;  // Relative to the roots, "." for the roots themselves
+  std::string what;  // The attribute that differs, e.g. "mtime"
+  std::string snapshot;  // Its value in the snapshot, "-" when absent
+  std::string live;      // Its value in the live tree, "-" when absent
+};
+
+// Called for every mismatch as soon as it is found. Runs concurrently on
+// the compare threads.
+using MismatchCallback = std::function<void(const Mismatch& mismatch)>;
+
+// Compare the snapshot directory at `snapshot_path` with the live
+// directory at `live_path`, both relative to the mount root. Returns
+// -EBADMSG if the trees differ, otherwise 0 or the first error.
+int VerifyTree(std::shared_ptr<ceph_mount_info> mount,
+               const std::string& snapshot_path, const std::string& live_path,
+               const VerifyOptions& options, MismatchCallback callback,
+               VerifyStats* stats = nullptr);
+
+// Log a mismatch found verifying `what` as one line.
+void LogMismatch(const std::string& what, const Mismatch& mismatch);
+
+#endif  // TESTSNAPSHOT_VERIFY_H_
@@ -0,0 +1,565 @@
+#include "walker.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "frontier.h"
+#include "inode_refs.h"
+#include "log.h"
+
+namespace {
+
+constexpr char kCheckpointMagic[8] = {'T', 'S', 'W', 'A', 'L', 'K', '0', '2'};
+// Older checkpoints, without the caller's state, are still resumed from
+constexpr char kCheckpointMagicV1[8] = {'T', 'S', 'W', 'A', 'L', 'K', '0', '1'};
+
+// Directory entries read between publishing discovered subdirectories and
+// the readdir offset to the shared state.
+constexpr size_t kFlushEntries = 256;
+
+bool WriteAll(FILE* file, const void* data, size_t size) {
+  return std::fwrite(data, 1, size, file) == size;
+}
+
+bool ReadAll(FILE* file, void* data, size_t size) {
+  return std::fread(data, 1, size, file) == size;
+}
+
+class Walker {
+ public:
+  Walker(std::shared_ptr<ceph_mount_info> mount, const vinodeno_t& root,
+         const WalkOptions& options, WalkHooks hooks)
+      : mount_(mount),
+        refs_(GetInodeRefs(mount.get())),
+        root_(root),
+        options_(options),
+        hooks_(std::move(hooks)),
+        frontier_(options.frontier_memory, options.spill_dir),
+        in_progress_(std::max<size_t>(1, options.threads)) {}
+
+  int Run(WalkStats* stats);
+
+ private:
+  void Work(size_t slot);
+  int ReadDirectory(const PendingDir& dir, size_t slot);
+  void Checkpoint();
+
+  // Everything a checkpoint holds, taken under the lock and written out
+  // without it
+  struct CheckpointState {
+    std::string head;  // Header, then the directories being read
+    FrontierSnapshot frontier;
+    std::string failed;  // Loaded last, so a resume retries them last
+  };
+
+  CheckpointState SnapshotLocked() const;
+  int SaveCheckpoint(const CheckpointState& state) const;
+  int LoadCheckpoint(bool& loaded);
+  void FailLocked(int result);
+
+  const std::shared_ptr<ceph_mount_info> mount_;
+  const std::shared_ptr<InodeRefs> refs_;
+  const vinodeno_t root_;
+  const WalkOptions options_;
+  const WalkHooks hooks_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable checkpoint_cv_;
+  Frontier frontier_;
+  // The directory each worker is reading, at its last published offset
+  std::vector<std::optional<PendingDir>> in_progress_;
+  size_t active_ = 0;
+  bool finished_ = false;
+  int error_ = 0;
+  std::vector<PendingDir> failed_;  // Directories that could not be read
+  int dir_error_ = 0;
+
+  std::atomic<bool> stop_{false};
+  std::atomic<uint64_t> dirs_{0};
+  std::atomic<uint64_t> entries_{0};
+  std::atomic<uint64_t> failed_dirs_{0};
+};
+
+int Walker::Run(WalkStats* stats) {
+  bool resumed = false;
+
+  if (not options_.checkpoint_path.empty()) {
+    int result = LoadCheckpoint(resumed);
+    if (result) {
+      return result;
+    }
+  }
+
+  if (resumed) {
+    LOG(kInfo) << "Resuming walk of {" << root_.ino.val << ", "
+               << root_.snapid.val << "} with " << frontier_.size()
+               << " pending directories from " << options_.checkpoint_path;
+  } else {
+    frontier_.PushBack({root_, "", 0});
+  }
+
+  std::thread checkpointer;
+  if (not options_.checkpoint_path.empty()) {
+    checkpointer = std::thread([this] { Checkpoint(); });
+  }
+
+  std::vector<std::thread> workers;
+  for (size_t slot = 0; slot < in_progress_.size(); ++slot) {
+    workers.emplace_back([this, slot] { Work(slot); });
+  }
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+  }
+  checkpoint_cv_.notify_all();
+
+  if (checkpointer.joinable()) {
+    checkpointer.join();
+  }
+
+  int result = error_;
+  if (result == 0 and stop_) {
+    result = -ECANCELED;
+  }
+  if (result == 0 and failed_dirs_) {
+    LOG(kError) << "Walk of {" << root_.ino.val << ", " << root_.snapid.val
+                << "} skipped " << failed_dirs_.load()
+                << " directories that could not be read";
+    result = dir_error_;
+  }
+
+  if (not options_.checkpoint_path.empty()) {
+    if (frontier_.empty() and (failed_.empty() or not stop_)) {
+      ::unlink(options_.checkpoint_path.c_str());
+    } else {
+      // Every unfinished directory was put back into the frontier or set
+      // aside as failed
+      std::unique_lock<std::mutex> lock(mutex_);
+      const CheckpointState state = SnapshotLocked();
+      lock.unlock();
+      SaveCheckpoint(state);
+    }
+  }
+
+  if (stats) {
+    stats->dirs = dirs_;
+    stats->entries = entries_;
+    stats->failed_dirs = failed_dirs_;
+    stats->resumed = resumed;
+  }
+
+  return result;
+}
+
+void Walker::Work(size_t slot) {
+  while (true) {
+    // Each directory pins its entries while they are read
+    WaitForInodeBudget(*refs_);
+
+    PendingDir dir;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this] {
+        return stop_ or not frontier_.empty() or active_ == 0;
+      });
+      if (stop_ or frontier_.empty()) {
+        work_cv_.notify_all();
+        return;
+      }
+
+      const int popped = frontier_.PopFront(dir);
+      if (popped <= 0) {
+        FailLocked(popped ? popped : -EIO);
+        work_cv_.notify_all();
+        return;
+      }
+      in_progress_[slot] = dir;
+      ++active_;
+    }
+
+    const int result = ReadDirectory(dir, slot);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (result == -ECANCELED) {
+        // Keep the directory for the checkpoint, from where it got to
+        frontier_.PushFront(std::move(*in_progress_[slot]));
+        FailLocked(result);
+      } else if (result) {
+        // Already logged. Set aside rather than put back, so that one
+        // unreadable directory stops neither this walk nor every resume;
+        // a checkpoint retries it after everything else.
+        failed_.push_back(std::move(*in_progress_[slot]));
+        ++failed_dirs_;
+        if (not dir_error_) {
+          dir_error_ = result;
+        }
+      } else {
+        ++dirs_;
+      }
+      in_progress_[slot].reset();
+      --active_;
+    }
+    work_cv_.notify_all();
+  }
+}
+
+int Walker::ReadDirectory(const PendingDir& dir, size_t slot) {
+  Inode* inode = nullptr;
+
+  int result = ceph_ll_lookup_vino(mount_.get(), dir.vino, &inode);
+  if (result) {
+    LOG(kError) << "Failed to lookup directory {" << dir.vino.ino.val << ", "
+                << dir.vino.snapid.val << "} " << dir.path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  auto mount = mount_;
+  std::shared_ptr<Inode> scoped_inode =
+      ScopeInode(mount, refs_, inode, dir.vino);
+
+  struct ceph_dir_result* dh = nullptr;
+
+  result = ceph_ll_opendir(mount.get(), inode, &dh,
+                           ceph_mount_perms(mount.get()));
+  if (result) {
+    LOG(kError) << "Failed to open directory " << dir.path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  std::shared_ptr<ceph_dir_result> scoped_dh(
+      dh, [mount](ceph_dir_result* dh) { ceph_ll_releasedir(mount.get(), dh); });
+
+  if (dir.offset) {
+    ceph_seekdir(mount.get(), dh, dir.offset);
+  }
+
+  WalkDir visit;
+  result = hooks_.dir(dir.path, scoped_inode, dir.offset, visit);
+  if (result) {
+    return result;
+  }
+
+  std::vector<PendingDir> children;
+  size_t unflushed = 0;
+
+  // Publish the subdirectories found so far together with the offset after
+  // the last delivered entry, so a checkpoint never loses or repeats a
+  // subtree.
+  auto flush = [&](int64_t offset) {
+    if (visit.sync) {
+      visit.sync();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto& child : children) {
+        // A failed spill keeps the entry buffered, so only stop
+        const int pushed = frontier_.PushBack(std::move(child));
+        if (pushed < 0) {
+          FailLocked(pushed);
+        }
+      }
+      in_progress_[slot]->offset = offset;
+    }
+    if (not children.empty()) {
+      work_cv_.notify_all();
+    }
+    children.clear();
+    unflushed = 0;
+  };
+
+  while (true) {
+    // Where a resume starts if this entry is not delivered
+    const int64_t position = ceph_telldir(mount.get(), dh);
+
+    if (stop_) {
+      flush(position);
+      return -ECANCELED;
+    }
+
+    dirent entry;
+    struct ceph_statx sb;
+    struct Inode* ceph_inode;
+
+    result = ceph_readdirplus_r(mount.get(), dh, &entry, &sb,
+                                CEPH_STATX_ALL_STATS, 0, &ceph_inode);
+    if (result < 0) {
+      LOG(kError) << "Failed to read directory " << dir.path << ": error "
+                  << -result << " (" << ::strerror(-result) << ")";
+      flush(position);
+      return result;
+    }
+
+    if (result == 0) {
+      break;
+    }
+
+    auto eh = ScopeInode(mount, refs_, ceph_inode, sb);
+
+    const std::string name(entry.d_name);
+    if (name == "." or name == "..") {
+      continue;
+    }
+
+    const std::string path = dir.path.empty() ? name : dir.path + "/" + name;
+
+    // A refused entry is delivered again on resume, so neither it nor its
+    // subtree is published
+    if (not visit.entry(path, sb, eh)) {
+      flush(position);
+      return -ECANCELED;
+    }
+
+    ++entries_;
+    if (S_ISDIR(sb.stx_mode)) {
+      children.push_back({{{sb.stx_ino}, {sb.stx_dev}}, path, 0});
+    }
+
+    if (++unflushed == kFlushEntries) {
+      flush(ceph_telldir(mount.get(), dh));
+    }
+  }
+
+  flush(ceph_telldir(mount.get(), dh));
+  return visit.finish ? visit.finish() : 0;
+}
+
+void Walker::FailLocked(int result) {
+  if (result != -ECANCELED and not error_) {
+    error_ = result;
+  }
+  stop_ = true;
+}
+
+void Walker::Checkpoint() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (not finished_) {
+    checkpoint_cv_.wait_for(lock, options_.checkpoint_interval,
+                            [this] { return finished_; });
+    if (finished_) {
+      break;
+    }
+
+    // Only the state is taken under the lock. Reading the spilled part of
+    // the frontier back, writing and syncing are done without it, so the
+    // workers do not stall for a large frontier.
+    const CheckpointState state = SnapshotLocked();
+    const uint64_t spilled = frontier_.spilled();
+    lock.unlock();
+
+    if (SaveCheckpoint(state) == 0) {
+      LOG(kInfo) << "Walk checkpoint: " << state.frontier.size()
+                 << " pending directories (" << spilled << " spilled), "
+                 << dirs_.load() << " directories and " << entries_.load()
+                 << " entries done";
+    }
+    lock.lock();
+  }
+}
+
+Walker::CheckpointState Walker::SnapshotLocked() const {
+  CheckpointState state;
+  std::string in_progress;
+  uint64_t count = frontier_.size() + failed_.size();
+
+  for (const auto& dir : in_progress_) {
+    if (dir) {
+      EncodePendingDir(*dir, in_progress);
+      ++count;
+    }
+  }
+  for (const auto& dir : failed_) {
+    EncodePendingDir(dir, state.failed);
+  }
+
+  state.head.assign(kCheckpointMagic, sizeof(kCheckpointMagic));
+  state.head.append(reinterpret_cast<const char*>(&root_.ino.val),
+                    sizeof(uint64_t));
+  state.head.append(reinterpret_cast<const char*>(&root_.snapid.val),
+                    sizeof(uint64_t));
+  state.head.append(reinterpret_cast<const char*>(&count), sizeof(count));
+
+  const std::string saved = hooks_.save_state ? hooks_.save_state() : "";
+  const uint64_t saved_size = saved.size();
+  state.head.append(reinterpret_cast<const char*>(&saved_size),
+                    sizeof(saved_size));
+  state.head.append(saved);
+  state.head.append(in_progress);
+
+  state.frontier = frontier_.Snapshot();
+  return state;
+}
+
+int Walker::SaveCheckpoint(const CheckpointState& state) const {
+  const std::string tmp_path = options_.checkpoint_path + ".tmp";
+
+  FILE* file = std::fopen(tmp_path.c_str(), "wb");
+  if (not file) {
+    const int result = -errno;
+    LOG(kError) << "Failed to create checkpoint " << tmp_path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  int result = 0;
+  if (not WriteAll(file, state.head.data(), state.head.size())) {
+    result = -errno;
+  }
+  if (result == 0) {
+    result = state.frontier.WriteTo(file);
+  }
+  if (result == 0 and
+      not WriteAll(file, state.failed.data(), state.failed.size())) {
+    result = -errno;
+  }
+  if (result == 0 and (std::fflush(file) or ::fsync(fileno(file)))) {
+    result = -errno;
+  }
+  std::fclose(file);
+
+  if (result) {
+    LOG(kError) << "Failed to write checkpoint " << tmp_path << ": error "
+                << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  if (std::rename(tmp_path.c_str(), options_.checkpoint_path.c_str())) {
+    result = -errno;
+    LOG(kError) << "Failed to replace checkpoint " << options_.checkpoint_path
+                << ": error " << -result << " (" << ::strerror(-result) << ")";
+    return result;
+  }
+
+  return 0;
+}
+
+int Walker::LoadCheckpoint(bool& loaded) {
+  loaded = false;
+
+  FILE* file = std::fopen(options_.checkpoint_path.c_str(), "rb");
+  if (not file) {
+    return errno == ENOENT ? 0 : -errno;
+  }
+
+  std::shared_ptr<FILE> scoped_file(file,
+                                    [](FILE* file) { std::fclose(file); });
+
+  char magic[sizeof(kCheckpointMagic)];
+  vinodeno_t root;
+  uint64_t count = 0;
+
+  if (not ReadAll(file, magic, sizeof(magic)) or
+      (std::memcmp(magic, kCheckpointMagic, sizeof(magic)) and
+       std::memcmp(magic, kCheckpointMagicV1, sizeof(magic))) or
+      not ReadAll(file, &root.ino.val, sizeof(uint64_t)) or
+      not ReadAll(file, &root.snapid.val, sizeof(uint64_t)) or
+      not ReadAll(file, &count, sizeof(count))) {
+    LOG(kError) << "Invalid checkpoint " << options_.checkpoint_path;
+    return -EINVAL;
+  }
+
+  std::string saved;
+  if (std::memcmp(magic, kCheckpointMagic, sizeof(magic)) == 0) {
+    // The caller's state is a few counters, not worth a chunked read
+    uint64_t saved_size = 0;
+    if (not ReadAll(file, &saved_size, sizeof(saved_size)) or
+        saved_size > (1 << 20)) {
+      LOG(kError) << "Invalid checkpoint " << options_.checkpoint_path;
+      return -EINVAL;
+    }
+    saved.resize(saved_size);
+    if (not ReadAll(file, saved.data(), saved.size())) {
+      LOG(kError) << "Truncated checkpoint " << options_.checkpoint_path;
+      return -EINVAL;
+    }
+  }
+
+  if (root.ino.val != root_.ino.val or root.snapid.val != root_.snapid.val) {
+    LOG(kError) << "Checkpoint " << options_.checkpoint_path
+                << " belongs to a walk of {" << root.ino.val << ", "
+                << root.snapid.val << "}";
+    return -EINVAL;
+  }
+
+  if (not saved.empty() and hooks_.load_state) {
+    int result = hooks_.load_state(saved);
+    if (result) {
+      return result;
+    }
+  }
+
+  std::string buffer;
+  std::vector<char> chunk(1 << 20);
+  uint64_t loaded_count = 0;
+
+  while (true) {
+    const size_t n = std::fread(chunk.data(), 1, chunk.size(), file);
+    buffer.append(chunk.data(), n);
+
+    const char* data = buffer.data();
+    const char* end = data + buffer.size();
+    PendingDir dir;
+
+    while (DecodePendingDir(data, end, dir)) {
+      int result = frontier_.PushBack(std::move(dir));
+      if (result) {
+        return result;
+      }
+      ++loaded_count;
+    }
+    buffer.erase(0, data - buffer.data());
+
+    if (n < chunk.size()) {
+      break;
+    }
+  }
+
+  if (loaded_count != count or not buffer.empty()) {
+    LOG(kError) << "Truncated checkpoint " << options_.checkpoint_path;
+    return -EINVAL;
+  }
+
+  loaded = true;
+  return 0;
+}
+
+}  // namespace
+
+int WalkTree(std::shared_ptr<ceph_mount_info> mount, const vinodeno_t& root,
+             const WalkOptions& options, WalkCallback callback,
+             WalkStats* stats) {
+  WalkHooks hooks;
+  hooks.dir = [callback = std::move(callback)](const std::string&,
+                                               std::shared_ptr<Inode>,
+                                               int64_t, WalkDir& dir) {
+    dir.entry = callback;
+    return 0;
+  };
+  return WalkTree(mount, root, options, std::move(hooks), stats);
+}
+
+int WalkTree(std::shared_ptr<ceph_mount_info> mount, const vinodeno_t& root,
+             const WalkOptions& options, WalkHooks hooks, WalkStats* stats) {
+  Walker walker(mount, root, options, std::move(hooks));
+  return walker.Run(stats);
+}
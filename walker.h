@@ -0,0 +1,87 @@
+#ifndef TESTSNAPSHOT_WALKER_H_
+#define TESTSNAPSHOT_WALKER_H_
+
+#include <cephfs/libcephfs.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "client.h"
+
+struct WalkOptions {
+  size_t threads = 8;
+  // When set, the pending directories and the readdir offset of every
+  // directory being read are saved here every `checkpoint_interval`. A walk
+  // started with an existing checkpoint for the same root resumes from it;
+  // the file is removed once the walk completes.
+  std::string checkpoint_path;
+  std::chrono::seconds checkpoint_interval{5};
+  // Pending directories beyond this many bytes are spilled to a temporary
+  // file in `spill_dir`.
+  size_t frontier_memory = 64 << 20;
+  std::string spill_dir = "/tmp";
+};
+
+struct WalkStats {
+  uint64_t dirs = 0;
+  uint64_t entries = 0;
+  uint64_t failed_dirs = 0;  // Could not be read, and were skipped
+  bool resumed = false;
+};
+
+// Called for every entry below the root with its path relative to the
+// root. Runs concurrently on the walker threads; returning false stops the
+// walk, and the refused entry is delivered again by a resumed walk. After a
+// resume from a periodic checkpoint, entries read since it was saved are
+// delivered again.
+using WalkCallback =
+    std::function<bool(const std::string& path, const struct ceph_statx& sb,
+                       std::shared_ptr<Inode> inode)>;
+
+// What the walk calls for the entries of one directory, on the walker
+// thread reading it. Only `entry` is required.
+struct WalkDir {
+  WalkCallback entry;
+  // Called before the offset past the entries delivered so far is recorded
+  // for a checkpoint. Returns once they are dealt with, so that a resume
+  // never skips an entry whose handling had not finished.
+  std::function<void()> sync;
+  // Called after the last entry was delivered and synced. A negative error
+  // fails the directory.
+  std::function<int()> finish;
+};
+
+// Sets up `dir` for the directory `inode` at `path` ("" for the root),
+// read from ceph_telldir() position `offset`, which is 0 unless resuming
+// from a checkpoint. A negative error fails the directory.
+using WalkDirCallback =
+    std::function<int(const std::string& path, std::shared_ptr<Inode> inode,
+                      int64_t offset, WalkDir& dir)>;
+
+struct WalkHooks {
+  WalkDirCallback dir;
+  // State of the caller's own, saved with every checkpoint (under the
+  // walker's lock) and handed back when a walk resumes from one.
+  std::function<std::string()> save_state;
+  std::function<int(const std::string& state)> load_state;
+};
+
+// Walk the directory tree below `root`, which may be a snapshot directory.
+// Directories are read in parallel. Pending directories are held as
+// {ino, snapid} and path only; an inode is pinned just while it is read.
+// A directory that cannot be read is logged and skipped; the walk carries
+// on and then returns the first such error.
+int WalkTree(std::shared_ptr<ceph_mount_info> mount, const vinodeno_t& root,
+             const WalkOptions& options, WalkCallback callback,
+             WalkStats* stats = nullptr);
+
+// WalkTree() for callers that handle a directory's entries together.
+int WalkTree(std::shared_ptr<ceph_mount_info> mount, const vinodeno_t& root,
+             const WalkOptions& options, WalkHooks hooks,
+             WalkStats* stats = nullptr);
+
+#endif  // TESTSNAPSHOT_WALKER_H_